@@ -44,19 +44,101 @@ sg_image sg_load_texture_memory(unsigned char *data, size_t data_size);
 sg_image sg_load_texture_path_ex(const char *path, unsigned int *width, unsigned int *height);
 sg_image sg_load_texture_memory_ex(unsigned char *data, size_t data_size, unsigned int *width, unsigned int *height);
 
+// Bytes needed for the RGBA pixels, read from the header. Returns 0 if the
+// data doesn't look like an image that can be loaded.
+size_t jeff_img_size(unsigned char *data, size_t data_size, unsigned int *width, unsigned int *height);
+// Decode RGBA pixels into `pixels`, starting each row `pitch` bytes after
+// the last. `pitch` is at least width * 4.
+int jeff_img_load_into(unsigned char *data, size_t data_size, void *pixels, size_t pitch);
+
+// Textures loaded in the background. Files are read and decoded on worker
+// threads, and the pixels wait in a queue for jeff_img_async_update to upload
+// them on the main thread. `threads` 0 uses one fewer than the number of
+// CPUs. At most `queue_size` decoded images (0 for 16) wait to be uploaded,
+// the workers stop until there's room. Starts with the defaults if it hasn't
+// been called before the first jeff_img_load_async. Returns 0 on failure.
+int jeff_img_async_init(int threads, int queue_size);
+// Stop the workers and drop anything not uploaded yet, its images are marked
+// failed. Call it before sg_shutdown.
+void jeff_img_async_shutdown(void);
+// Returns an image that's only allocated, sg_query_image_state says
+// SG_RESOURCESTATE_ALLOC until it's uploaded (immutable, RGBA8) and VALID
+// after, or FAILED if it couldn't be loaded. It can be bound in the
+// meantime, draws using it are skipped.
+sg_image jeff_img_load_async(const char *path);
+// Upload decoded images, call once per frame from the frame callback. Stops
+// once `max_bytes` of pixels have gone up (0 for no limit), but always
+// uploads at least one. Returns the number of images finished, including
+// any that failed.
+int jeff_img_async_update(size_t max_bytes);
+// Images from jeff_img_load_async that haven't been uploaded yet
+int jeff_img_async_pending(void);
+
+// Textures shared by path, acquiring a path that's already loaded gives back
+// the same image. Paths are normalised first, so "a\b/./c/../d.png" is the
+// same texture as "a/b/d.png" (and letter case is ignored on Windows), but
+// symlinks and relative vs absolute paths aren't resolved. The textures are
+// immutable RGBA8. Only use these from the thread that makes sokol calls.
+// Returns SG_INVALID_ID if the file can't be loaded.
+sg_image jeff_img_cache_acquire(const char *path, unsigned int *width, unsigned int *height);
+// Drop a reference from jeff_img_cache_acquire, the image is destroyed once
+// every acquire has been released (without a budget, see below)
+void jeff_img_cache_release(sg_image image);
+// Also hash the contents of every file loaded (FNV-1a), a new path with the
+// same contents as a cached texture shares its image instead of loading a
+// copy. Only applies to textures loaded after it's turned on.
+void jeff_img_cache_content_hash(int enabled);
+// With a budget, released textures stay on the GPU until the cache's
+// textures take up more than `bytes` of memory. Then the least recently used
+// ones nobody has acquired are evicted. Their image is uninitialised but keeps
+// its handle, and the next acquire loads it back into the same image. Textures
+// that are acquired are never evicted, so the cache can still go over. 0 (the
+// default) destroys textures as soon as they're released.
+void jeff_img_cache_budget(size_t bytes);
+// Keep each file in memory once it's loaded, so evicted textures are decoded
+// again from that rather than read from disk
+void jeff_img_cache_keep_files(int enabled);
+// Call once per frame, textures are evicted in order of the frame they were
+// last acquired or released
+void jeff_img_cache_frame(void);
+typedef struct {
+    unsigned int hits;       // found by path
+    unsigned int shared;     // a new path with the same contents as a cached texture
+    unsigned int misses;     // loaded from the file
+    unsigned int evictions;  // textures taken off the GPU to stay in the budget
+    unsigned int reloads;    // evicted textures loaded again
+    int textures;            // images in the cache, evicted or not
+    int resident;            // textures on the GPU
+    size_t bytes;            // GPU memory used by the resident textures
+    size_t file_bytes;       // files kept in memory by jeff_img_cache_keep_files
+} jeff_img_cache_stats;
+void jeff_img_cache_get_stats(jeff_img_cache_stats *stats);
+// Destroy every cached image, acquired or not, and reset the counters
+void jeff_img_cache_clear(void);
+
 #if defined(__cplusplus)
 }
 #endif
 #endif // JEFF_INPUT
 
 #ifdef JEFF_IMPL
+#include <stdint.h>
 #ifdef _WIN32
-#include <io.h>
 #include <dirent.h>
-#define F_OK 0
-#define access _access
 #else
 #include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+// Images from jeff_img_load_async are decoded on worker threads, define
+// JEFF_IMG_NO_THREADS to decode them in jeff_img_async_update instead
+#ifndef JEFF_IMG_NO_THREADS
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
 #endif
 #define STB_IMAGE_IMPLEMENTATION
 #include "deps/stb_image.h"
@@ -74,8 +156,85 @@ sg_image sg_empty_texture(unsigned int width, unsigned int height) {
     return sg_make_image(&desc);
 }
 
-static int does_file_exist(const char *path) {
-    return !access(path, F_OK);
+// Files are mapped rather than read into memory where mmap is available, the
+// decoders read straight from the mapping. Anything that can't be mapped (or
+// everything, with JEFF_IMG_NO_MMAP) is read into a buffer instead.
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    int mapped;
+} FileData;
+
+static int file_load(const char *path, FileData *f) {
+    unsigned char *buf = NULL, *grown;
+    size_t cap, len = 0;
+    FILE *fh;
+    long sz;
+    int c, ok;
+    f->mapped = 0;
+#if !defined(_WIN32) && !defined(JEFF_IMG_NO_MMAP)
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+        int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+        flags |= MAP_POPULATE;
+#endif
+        void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, flags, fd, 0);
+        if (p != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+            madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+            close(fd);
+            f->data = p;
+            f->size = (size_t)st.st_size;
+            f->mapped = 1;
+            return 1;
+        }
+    }
+    close(fd);
+#endif
+    
+    if (!(fh = fopen(path, "rb")))
+        return 0;
+    cap = !fseek(fh, 0, SEEK_END) && (sz = ftell(fh)) > 0 ? (size_t)sz : 4096;
+    fseek(fh, 0, SEEK_SET);
+    // Pipes and the like don't know their size, so keep growing to the end.
+    while ((grown = realloc(buf, cap))) {
+        buf = grown;
+        len += fread(buf + len, 1, cap - len, fh);
+        if (len < cap || (c = fgetc(fh)) == EOF || ungetc(c, fh) == EOF)
+            break;
+        cap += cap / 2;
+    }
+    ok = grown && len && !ferror(fh);
+    fclose(fh);
+    if (!ok) {
+        free(buf);
+        return 0;
+    }
+    f->data = buf;
+    f->size = len;
+    return 1;
+}
+
+static void file_unload(FileData *f) {
+#if !defined(_WIN32) && !defined(JEFF_IMG_NO_MMAP)
+    if (f->mapped) {
+        munmap(f->data, f->size);
+        return;
+    }
+#endif
+    free(f->data);
+}
+
+// strdup isn't declared by a strict -std=c99 build.
+static char* copy_string(const char *str) {
+    size_t len = strlen(str) + 1;
+    char *copy = malloc(len);
+    return copy ? memcpy(copy, str, len) : NULL;
 }
 
 static const char* file_extension(const char *path) {
@@ -83,17 +242,16 @@ static const char* file_extension(const char *path) {
     return !dot || dot == path ? NULL : dot + 1;
 }
 
-sg_image sg_load_texture_path_ex(const char *path, unsigned int *width, unsigned int *height) {
-    if (!does_file_exist(path))
-        return (sg_image){.id=SG_INVALID_ID};
-    
+static int valid_extension(const char *path) {
 #define VALID_EXTS_SZ 11
     static const char *valid_extensions[VALID_EXTS_SZ] = {
         "jpg", "jpeg", "png", "bmp", "psd", "tga", "hdr", "pic", "ppm", "pgm", "qoi"
     };
     const char *ext = file_extension(path);
+    if (!ext)
+        return 0;
     unsigned long ext_length = strlen(ext);
-    char *dup = strdup(ext);
+    char *dup = copy_string(ext);
     for (int i = 0; i < ext_length; i++)
         if (dup[i] >= 'A' && dup[i] <= 'Z')
             dup[i] += 32;
@@ -105,21 +263,18 @@ sg_image sg_load_texture_path_ex(const char *path, unsigned int *width, unsigned
         }
     }
     free(dup);
-    if (!found)
+    return found;
+}
+
+sg_image sg_load_texture_path_ex(const char *path, unsigned int *width, unsigned int *height) {
+    if (!valid_extension(path))
         return (sg_image){.id=SG_INVALID_ID};
     
-    size_t sz = -1;
-    FILE *fh = fopen(path, "rb");
-    assert(fh);
-    fseek(fh, 0, SEEK_END);
-    sz = ftell(fh);
-    fseek(fh, 0, SEEK_SET);
-    
-    unsigned char *data = malloc(sz * sizeof(unsigned char));
-    fread(data, sz, 1, fh);
-    fclose(fh);
-    sg_image result = sg_load_texture_memory_ex(data, (int)sz, width, height);
-    free(data);
+    FileData file;
+    if (!file_load(path, &file))
+        return (sg_image){.id=SG_INVALID_ID};
+    sg_image result = sg_load_texture_memory_ex(file.data, file.size, width, height);
+    file_unload(&file);
     return result;
 }
 
@@ -129,45 +284,79 @@ static int check_if_qoi(unsigned char *data) {
     return (data[0] << 24 | data[1] << 16 | data[2] << 8 | data[3]) == QOI_MAGIC;
 }
 
-#define RGBA(R, G, B, A) (((unsigned int)(A) << 24) | ((unsigned int)(B) << 16) | ((unsigned int)(G) << 8) | (R))
-
-static int* load_texture_data(unsigned char *data, size_t data_size, unsigned int *w, unsigned int *h) {
-    assert(data && data_size);
-    int _w, _h, c;
-    unsigned char *in = NULL;
-    if (check_if_qoi(data)) {
+static unsigned char* load_rgba(unsigned char *data, size_t data_size, int *w, int *h) {
+    int c;
+    if (data_size >= 4 && check_if_qoi(data)) {
         qoi_desc desc;
-        in = qoi_decode(data, (int)data_size, &desc, 4);
-        _w = desc.width;
-        _h = desc.height;
+        unsigned char *in = qoi_decode(data, (int)data_size, &desc, 4);
+        *w = desc.width;
+        *h = desc.height;
+        return in;
     } else
-        in = stbi_load_from_memory(data, (int)data_size, &_w, &_h, &c, 4);
+        return stbi_load_from_memory(data, (int)data_size, w, h, &c, 4);
+}
+
+// stb and qoi already hand back rows of R, G, B, A bytes, which is exactly
+// what SG_PIXELFORMAT_RGBA8 wants, so the decoder's buffer is uploaded as is.
+static unsigned char* load_texture_data(unsigned char *data, size_t data_size, unsigned int *w, unsigned int *h) {
+    assert(data && data_size);
+    int _w, _h;
+    unsigned char *in = load_rgba(data, data_size, &_w, &_h);
     assert(in && _w && _h);
-    
-    int *buf = malloc(_w * _h * sizeof(int));
-    for (int x = 0; x < _w; x++)
-        for (int y = 0; y < _h; y++) {
-            unsigned char *p = in + (x + _w * y) * 4;
-            buf[y * _w + x] = RGBA(p[0], p[1], p[2], p[3]);
-        }
-    free(in);
     if (w)
         *w = _w;
     if (h)
         *h = _h;
-    return buf;
+    return in;
+}
+
+size_t jeff_img_size(unsigned char *data, size_t data_size, unsigned int *width, unsigned int *height) {
+    assert(data && data_size);
+    int w, h, c;
+    if (data_size >= 4 && check_if_qoi(data)) {
+        if (data_size < 14)
+            return 0;
+        w = data[4] << 24 | data[5] << 16 | data[6] << 8 | data[7];
+        h = data[8] << 24 | data[9] << 16 | data[10] << 8 | data[11];
+    } else if (!stbi_info_from_memory(data, (int)data_size, &w, &h, &c))
+        return 0;
+    if (w <= 0 || h <= 0)
+        return 0;
+    if (width)
+        *width = w;
+    if (height)
+        *height = h;
+    return (size_t)w * h * 4;
+}
+
+int jeff_img_load_into(unsigned char *data, size_t data_size, void *pixels, size_t pitch) {
+    assert(data && data_size && pixels);
+    // stb and qoi only decode into their own memory, the rows are already
+    // RGBA so they're just copied across.
+    int w, h;
+    unsigned char *in = load_rgba(data, data_size, &w, &h);
+    if (!in)
+        return 0;
+    if (pitch < (size_t)w * 4) {
+        free(in);
+        return 0;
+    }
+    for (int y = 0; y < h; y++)
+        memcpy((unsigned char*)pixels + y * pitch, in + (size_t)y * w * 4, (size_t)w * 4);
+    free(in);
+    return 1;
 }
 
 sg_image sg_load_texture_memory_ex(unsigned char *data, size_t data_size, unsigned int *width, unsigned int *height) {
     assert(data && data_size);
     unsigned int w, h;
-    int *tmp = load_texture_data(data, data_size, &w, &h);
+    unsigned char *tmp = load_texture_data(data, data_size, &w, &h);
     assert(tmp && w && h);
     sg_image texture = sg_empty_texture(w, h);
     sg_image_data desc = {
         .subimage[0][0] = (sg_range) {
             .ptr = tmp,
-            .size = w * h * sizeof(int)
+            .size = (size_t)w * h * 4
         }
     };
     sg_update_image(texture, &desc);
@@ -186,4 +375,765 @@ sg_image sg_load_texture_path(const char *path) {
 sg_image sg_load_texture_memory(unsigned char *data, size_t data_size) {
     return sg_load_texture_memory_ex(data, data_size, NULL, NULL);
 }
+// Give an image from sg_alloc_image its pixels, as an immutable RGBA8 texture
+static void init_texture(sg_image image, const unsigned char *pixels, int w, int h) {
+    sg_image_desc desc = {
+        .width = w,
+        .height = h,
+        .pixel_format = SG_PIXELFORMAT_RGBA8,
+        .data.subimage[0][0] = (sg_range) {
+            .ptr = pixels,
+            .size = (size_t)w * h * 4
+        }
+    };
+    sg_init_image(image, &desc);
+}
+
+#define ASYNC_MAX_THREADS 16
+
+typedef struct AsyncJob {
+    sg_image image;
+    char *path;
+    unsigned char *pixels;  // NULL if it couldn't be loaded
+    int w, h;
+    struct AsyncJob *next;
+} AsyncJob;
+
+typedef struct {
+    AsyncJob *head, *tail;
+    int count;
+} AsyncQueue;
+
+#ifndef JEFF_IMG_NO_THREADS
+#ifdef _WIN32
+typedef CRITICAL_SECTION AsyncMutex;
+typedef CONDITION_VARIABLE AsyncCond;
+typedef HANDLE AsyncThread;
+#else
+typedef pthread_mutex_t AsyncMutex;
+typedef pthread_cond_t AsyncCond;
+typedef pthread_t AsyncThread;
+#endif
+#endif
+
+// `todo` is waiting for a worker, `done` is decoded and waiting to be
+// uploaded. `pending` is only touched on the main thread.
+static struct {
+    AsyncQueue todo, done;
+    int running, pending, done_max;
+#ifndef JEFF_IMG_NO_THREADS
+    AsyncMutex lock;
+    AsyncCond work, room;
+    AsyncThread threads[ASYNC_MAX_THREADS];
+    int thread_count;
+#endif
+} async;
+
+static void queue_push(AsyncQueue *q, AsyncJob *job) {
+    job->next = NULL;
+    if (q->tail)
+        q->tail->next = job;
+    else
+        q->head = job;
+    q->tail = job;
+    q->count++;
+}
+
+static AsyncJob* queue_pop(AsyncQueue *q) {
+    AsyncJob *job = q->head;
+    if (job) {
+        if (!(q->head = job->next))
+            q->tail = NULL;
+        q->count--;
+    }
+    return job;
+}
+
+static void async_lock(void) {
+#ifndef JEFF_IMG_NO_THREADS
+#ifdef _WIN32
+    EnterCriticalSection(&async.lock);
+#else
+    pthread_mutex_lock(&async.lock);
+#endif
+#endif
+}
+
+static void async_unlock(void) {
+#ifndef JEFF_IMG_NO_THREADS
+#ifdef _WIN32
+    LeaveCriticalSection(&async.lock);
+#else
+    pthread_mutex_unlock(&async.lock);
+#endif
+#endif
+}
+
+static void async_decode(AsyncJob *job) {
+    FileData file;
+    if (file_load(job->path, &file)) {
+        job->pixels = load_rgba(file.data, file.size, &job->w, &job->h);
+        file_unload(&file);
+    }
+    free(job->path);
+    job->path = NULL;
+}
+
+static void async_free(AsyncJob *job) {
+    free(job->path);
+    free(job->pixels);
+    free(job);
+}
+
+#ifndef JEFF_IMG_NO_THREADS
+static void async_wait(AsyncCond *cond) {
+#ifdef _WIN32
+    SleepConditionVariableCS(cond, &async.lock, INFINITE);
+#else
+    pthread_cond_wait(cond, &async.lock);
+#endif
+}
+
+static void async_wake(AsyncCond *cond, int all) {
+#ifdef _WIN32
+    if (all)
+        WakeAllConditionVariable(cond);
+    else
+        WakeConditionVariable(cond);
+#else
+    if (all)
+        pthread_cond_broadcast(cond);
+    else
+        pthread_cond_signal(cond);
+#endif
+}
+
+static void async_work(void) {
+    AsyncJob *job;
+    async_lock();
+    for (;;) {
+        while (!async.todo.head && async.running)
+            async_wait(&async.work);
+        if (!async.running)
+            break;
+        job = queue_pop(&async.todo);
+        async_unlock();
+        async_decode(job);
+        async_lock();
+        // Hold on to it until there's room, so a burst of loads doesn't keep
+        // every decoded image in memory at once.
+        while (async.done.count >= async.done_max && async.running)
+            async_wait(&async.room);
+        queue_push(&async.done, job);
+    }
+    async_unlock();
+}
+
+#ifdef _WIN32
+static DWORD WINAPI async_thread(LPVOID arg) {
+    (void)arg;
+    async_work();
+    return 0;
+}
+#else
+static void* async_thread(void *arg) {
+    (void)arg;
+    async_work();
+    return NULL;
+}
+#endif
+
+static int cpu_count(void) {
+#ifdef _WIN32
+    SYSTEM_INFO info;
+    GetSystemInfo(&info);
+    return (int)info.dwNumberOfProcessors;
+#else
+    return (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+}
+#endif
+
+int jeff_img_async_init(int threads, int queue_size) {
+    if (async.running)
+        return 1;
+    async.done_max = queue_size > 0 ? queue_size : 16;
+    async.pending = 0;
+#ifndef JEFF_IMG_NO_THREADS
+    if (threads <= 0)
+        threads = cpu_count() - 1;
+    if (threads < 1)
+        threads = 1;
+    if (threads > ASYNC_MAX_THREADS)
+        threads = ASYNC_MAX_THREADS;
+#ifdef _WIN32
+    InitializeCriticalSection(&async.lock);
+    InitializeConditionVariable(&async.work);
+    InitializeConditionVariable(&async.room);
+#else
+    pthread_mutex_init(&async.lock, NULL);
+    pthread_cond_init(&async.work, NULL);
+    pthread_cond_init(&async.room, NULL);
+#endif
+    async.running = 1;
+    for (async.thread_count = 0; async.thread_count < threads; async.thread_count++) {
+#ifdef _WIN32
+        if (!(async.threads[async.thread_count] = CreateThread(NULL, 0, async_thread, NULL, 0, NULL)))
+            break;
+#else
+        if (pthread_create(&async.threads[async.thread_count], NULL, async_thread, NULL))
+            break;
+#endif
+    }
+    if (!async.thread_count) {
+        async.running = 0;
+#ifdef _WIN32
+        DeleteCriticalSection(&async.lock);
+#else
+        pthread_mutex_destroy(&async.lock);
+        pthread_cond_destroy(&async.work);
+        pthread_cond_destroy(&async.room);
+#endif
+        return 0;
+    }
+#else
+    async.running = 1;
+#endif
+    return 1;
+}
+
+void jeff_img_async_shutdown(void) {
+    AsyncJob *job;
+    if (!async.running)
+        return;
+#ifndef JEFF_IMG_NO_THREADS
+    async_lock();
+    async.running = 0;
+    async_wake(&async.work, 1);
+    async_wake(&async.room, 1);
+    async_unlock();
+    for (int i = 0; i < async.thread_count; i++) {
+#ifdef _WIN32
+        WaitForSingleObject(async.threads[i], INFINITE);
+        CloseHandle(async.threads[i]);
+#else
+        pthread_join(async.threads[i], NULL);
+#endif
+    }
+#ifdef _WIN32
+    DeleteCriticalSection(&async.lock);
+#else
+    pthread_mutex_destroy(&async.lock);
+    pthread_cond_destroy(&async.work);
+    pthread_cond_destroy(&async.room);
+#endif
+#else
+    async.running = 0;
+#endif
+    while ((job = queue_pop(&async.todo)) || (job = queue_pop(&async.done))) {
+        if (sg_query_image_state(job->image) == SG_RESOURCESTATE_ALLOC)
+            sg_fail_image(job->image);
+        async_free(job);
+    }
+    async.pending = 0;
+}
+
+sg_image jeff_img_load_async(const char *path) {
+    AsyncJob *job;
+    if (!valid_extension(path) || (!async.running && !jeff_img_async_init(0, 0)))
+        return (sg_image){.id=SG_INVALID_ID};
+    if (!(job = calloc(1, sizeof(AsyncJob))))
+        return (sg_image){.id=SG_INVALID_ID};
+    if (!(job->path = copy_string(path)) || (job->image = sg_alloc_image()).id == SG_INVALID_ID) {
+        async_free(job);
+        return (sg_image){.id=SG_INVALID_ID};
+    }
+    async_lock();
+    queue_push(&async.todo, job);
+#ifndef JEFF_IMG_NO_THREADS
+    async_wake(&async.work, 0);
+#endif
+    async_unlock();
+    async.pending++;
+    return job->image;
+}
+
+int jeff_img_async_update(size_t max_bytes) {
+    AsyncJob *job;
+    size_t bytes = 0;
+    int n = 0;
+    while (async.running && (!max_bytes || !n || bytes < max_bytes)) {
+        async_lock();
+        if ((job = queue_pop(&async.done))) {
+#ifndef JEFF_IMG_NO_THREADS
+            async_wake(&async.room, 0);
+#endif
+        }
+        async_unlock();
+#ifdef JEFF_IMG_NO_THREADS
+        if (!job && (job = queue_pop(&async.todo)))
+            async_decode(job);
+#endif
+        if (!job)
+            break;
+        // The placeholder may have been destroyed while it was loading.
+        if (sg_query_image_state(job->image) == SG_RESOURCESTATE_ALLOC) {
+            if (job->pixels) {
+                init_texture(job->image, job->pixels, job->w, job->h);
+                bytes += (size_t)job->w * job->h * 4;
+            } else
+                sg_fail_image(job->image);
+        }
+        async.pending--;
+        async_free(job);
+        n++;
+    }
+    return n;
+}
+
+int jeff_img_async_pending(void) {
+    return async.pending;
+}
+
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
+
+static uint64_t fnv1a(const void *data, size_t size) {
+    const unsigned char *p = data;
+    uint64_t hash = FNV_OFFSET;
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ p[i]) * FNV_PRIME;
+    return hash;
+}
+
+typedef struct {
+    sg_image image;  // SG_INVALID_ID for a free slot
+    int w, h, refs;
+    int hashed;      // contents were hashed when it was loaded
+    uint64_t contents;
+    size_t size;     // of the file
+    char *file;      // the path it was loaded from, to load it again
+    unsigned char *copy;  // the file, with jeff_img_cache_keep_files
+    size_t bytes;    // GPU memory while it's resident, always RGBA8
+    int resident;    // evicted textures are only allocated
+    unsigned frame;  // when it was last acquired or released
+    uint64_t use;    // orders uses within a frame
+} CacheEntry;
+
+// The paths and images are found through open addressing tables of these.
+// A slot with no path (or id) is empty, or a removed one if `entry` is -1.
+typedef struct {
+    char *path;
+    uint64_t hash;
+    int entry;
+} CachePath;
+
+typedef struct {
+    uint32_t id;
+    int entry;
+} CacheImage;
+
+static struct {
+    CacheEntry *entries;
+    int entry_count;
+    CachePath *paths;
+    int path_slots, path_used;  // used counts removed slots too
+    CacheImage *images;
+    int image_slots, image_used;
+    int content_hash, keep_files;
+    size_t budget;
+    unsigned frame;
+    uint64_t use;
+    jeff_img_cache_stats stats;
+} cache;
+
+// Separators become '/', empty and "." parts go and ".." takes the part
+// before it off, unless there's nothing left to take.
+static char* normalise_path(const char *path) {
+    size_t len = 0, keep = 0, root = 0, n;
+    const char *p = path, *part;
+    char *out = malloc(strlen(path) + 1);
+    if (!out)
+        return NULL;
+    if (*p == '/' || *p == '\\')
+        out[len++] = '/';
+    keep = root = len;
+    while (*p) {
+        while (*p == '/' || *p == '\\')
+            p++;
+        for (part = p; *p && *p != '/' && *p != '\\'; p++);
+        if (!(n = p - part) || (n == 1 && part[0] == '.'))
+            continue;
+        if (n == 2 && part[0] == '.' && part[1] == '.') {
+            if (len > keep) {
+                while (len > keep && out[len - 1] != '/')
+                    len--;
+                if (len > root)
+                    len--;
+                continue;
+            }
+            if (root)
+                continue;
+        }
+        if (len > root)
+            out[len++] = '/';
+        memcpy(out + len, part, n);
+        len += n;
+        // Leading ".." parts of a relative path stay.
+        if (n == 2 && part[0] == '.' && part[1] == '.')
+            keep = len;
+    }
+    out[len] = '\0';
+#ifdef _WIN32
+    for (n = 0; n < len; n++)
+        if (out[n] >= 'A' && out[n] <= 'Z')
+            out[n] += 32;
+#endif
+    return out;
+}
+
+static CachePath* cache_path_slot(const char *path, uint64_t hash) {
+    CachePath *removed = NULL;
+    for (int i = hash & (cache.path_slots - 1);; i = (i + 1) & (cache.path_slots - 1)) {
+        CachePath *slot = &cache.paths[i];
+        if (!slot->path) {
+            if (slot->entry != -1)
+                return removed ? removed : slot;
+            if (!removed)
+                removed = slot;
+        } else if (slot->hash == hash && !strcmp(slot->path, path))
+            return slot;
+    }
+}
+
+static CacheImage* cache_image_slot(sg_image image) {
+    CacheImage *removed = NULL;
+    uint32_t hash = image.id * 2654435761u;
+    for (int i = hash & (cache.image_slots - 1);; i = (i + 1) & (cache.image_slots - 1)) {
+        CacheImage *slot = &cache.images[i];
+        if (!slot->id) {
+            if (slot->entry != -1)
+                return removed ? removed : slot;
+            if (!removed)
+                removed = slot;
+        } else if (slot->id == image.id)
+            return slot;
+    }
+}
+
+// Make room for one more in each table, they're rebuilt without the removed
+// slots once three quarters are used.
+static int cache_reserve(void) {
+    if ((cache.path_used + 1) * 4 > cache.path_slots * 3) {
+        CachePath *old = cache.paths;
+        int old_slots = cache.path_slots;
+        int live = 0;
+        for (int i = 0; i < old_slots; i++)
+            live += old[i].path != NULL;
+        int slots = 64;
+        while ((live + 1) * 2 > slots)
+            slots *= 2;
+        if (!(cache.paths = calloc(slots, sizeof(CachePath)))) {
+            cache.paths = old;
+            return 0;
+        }
+        cache.path_slots = slots;
+        cache.path_used = live;
+        for (int i = 0; i < old_slots; i++)
+            if (old[i].path)
+                *cache_path_slot(old[i].path, old[i].hash) = old[i];
+        free(old);
+    }
+    if ((cache.image_used + 1) * 4 > cache.image_slots * 3) {
+        CacheImage *old = cache.images;
+        int old_slots = cache.image_slots;
+        int live = 0;
+        for (int i = 0; i < old_slots; i++)
+            live += old[i].id != 0;
+        int slots = 64;
+        while ((live + 1) * 2 > slots)
+            slots *= 2;
+        if (!(cache.images = calloc(slots, sizeof(CacheImage)))) {
+            cache.images = old;
+            return 0;
+        }
+        cache.image_slots = slots;
+        cache.image_used = live;
+        for (int i = 0; i < old_slots; i++)
+            if (old[i].id)
+                *cache_image_slot((sg_image){.id=old[i].id}) = old[i];
+        free(old);
+    }
+    return 1;
+}
+
+static int cache_new_entry(void) {
+    CacheEntry *grown;
+    for (int i = 0; i < cache.entry_count; i++)
+        if (cache.entries[i].image.id == SG_INVALID_ID)
+            return i;
+    if (!(grown = realloc(cache.entries, (cache.entry_count + 1) * sizeof(CacheEntry))))
+        return -1;
+    cache.entries = grown;
+    cache.entries[cache.entry_count].image.id = SG_INVALID_ID;
+    return cache.entry_count++;
+}
+
+static void cache_remove(int entry) {
+    CacheEntry *e = &cache.entries[entry];
+    CacheImage *image = cache_image_slot(e->image);
+    image->id = 0;
+    image->entry = -1;
+    // Every path that shares it goes too, there's usually just the one.
+    for (int i = 0; i < cache.path_slots; i++) {
+        CachePath *slot = &cache.paths[i];
+        if (slot->path && slot->entry == entry) {
+            free(slot->path);
+            slot->path = NULL;
+            slot->entry = -1;
+        }
+    }
+    if (e->resident) {
+        cache.stats.bytes -= e->bytes;
+        cache.stats.resident--;
+    }
+    if (e->copy)
+        cache.stats.file_bytes -= e->size;
+    sg_destroy_image(e->image);
+    free(e->file);
+    free(e->copy);
+    e->image.id = SG_INVALID_ID;
+    cache.stats.textures--;
+}
+
+static void cache_stamp(CacheEntry *e) {
+    e->frame = cache.frame;
+    e->use = cache.use++;
+}
+
+// Evict unacquired textures, least recently used first, until another
+// `bytes` fit in the budget or there's nothing left that can go.
+static void cache_trim(size_t bytes) {
+    while (cache.budget && cache.stats.bytes + bytes > cache.budget) {
+        CacheEntry *lru = NULL;
+        for (int i = 0; i < cache.entry_count; i++) {
+            CacheEntry *e = &cache.entries[i];
+            if (e->image.id == SG_INVALID_ID || !e->resident || e->refs)
+                continue;
+            if (!lru || e->frame < lru->frame || (e->frame == lru->frame && e->use < lru->use))
+                lru = e;
+        }
+        if (!lru)
+            break;
+        sg_uninit_image(lru->image);
+        lru->resident = 0;
+        cache.stats.bytes -= lru->bytes;
+        cache.stats.resident--;
+        cache.stats.evictions++;
+    }
+}
+
+// Decode a file into the entry's allocated image, making room for it first
+static int cache_upload(CacheEntry *e, unsigned char *data, size_t size) {
+    int w, h;
+    unsigned char *pixels = load_rgba(data, size, &w, &h);
+    if (!pixels)
+        return 0;
+    e->w = w;
+    e->h = h;
+    e->bytes = (size_t)w * h * 4;
+    cache_trim(e->bytes);
+    init_texture(e->image, pixels, w, h);
+    free(pixels);
+    if (sg_query_image_state(e->image) != SG_RESOURCESTATE_VALID) {
+        sg_uninit_image(e->image);
+        return 0;
+    }
+    e->resident = 1;
+    cache.stats.bytes += e->bytes;
+    cache.stats.resident++;
+    return 1;
+}
+
+static int cache_reload(int entry) {
+    CacheEntry *e = &cache.entries[entry];
+    FileData file;
+    int ok;
+    if (e->copy)
+        ok = cache_upload(e, e->copy, e->size);
+    else if ((ok = file_load(e->file, &file))) {
+        ok = cache_upload(e, file.data, file.size);
+        file_unload(&file);
+    }
+    if (!ok) {
+        cache_remove(entry);
+        return 0;
+    }
+    cache.stats.reloads++;
+    return 1;
+}
+
+sg_image jeff_img_cache_acquire(const char *path, unsigned int *width, unsigned int *height) {
+    sg_image invalid = {.id=SG_INVALID_ID};
+    CachePath *slot;
+    CacheEntry *e;
+    FileData file;
+    uint64_t hash, contents = 0;
+    int entry = -1;
+    char *key;
+    
+    if (!cache_reserve() || !(key = normalise_path(path)))
+        return invalid;
+    hash = fnv1a(key, strlen(key));
+    slot = cache_path_slot(key, hash);
+    if (slot->path) {
+        free(key);
+        entry = slot->entry;
+        cache.stats.hits++;
+        goto found;
+    }
+    
+    // The file is still opened by the name it was given, the normalised one
+    // might not reach it through a symlink.
+    if (!valid_extension(path) || !file_load(path, &file)) {
+        free(key);
+        return invalid;
+    }
+    if (cache.content_hash) {
+        contents = fnv1a(file.data, file.size);
+        for (int i = 0; i < cache.entry_count; i++) {
+            e = &cache.entries[i];
+            if (e->image.id != SG_INVALID_ID && e->hashed && e->contents == contents && e->size == file.size) {
+                entry = i;
+                break;
+            }
+        }
+    }
+    if (entry >= 0)
+        cache.stats.shared++;
+    else {
+        sg_image image = sg_alloc_image();
+        if (image.id == SG_INVALID_ID || (entry = cache_new_entry()) < 0) {
+            if (image.id != SG_INVALID_ID)
+                sg_dealloc_image(image);
+            file_unload(&file);
+            free(key);
+            return invalid;
+        }
+        e = &cache.entries[entry];
+        memset(e, 0, sizeof(CacheEntry));
+        e->image = image;
+        e->hashed = cache.content_hash;
+        e->contents = contents;
+        e->size = file.size;
+        if (!cache_upload(e, file.data, file.size) || !(e->file = copy_string(path))
+            || (cache.keep_files && !(e->copy = malloc(file.size)))) {
+            if (e->resident) {
+                cache.stats.bytes -= e->bytes;
+                cache.stats.resident--;
+            }
+            sg_destroy_image(image);
+            free(e->file);
+            e->image.id = SG_INVALID_ID;
+            file_unload(&file);
+            free(key);
+            return invalid;
+        }
+        if (e->copy) {
+            memcpy(e->copy, file.data, file.size);
+            cache.stats.file_bytes += file.size;
+        }
+        CacheImage *islot = cache_image_slot(image);
+        if (!islot->id && islot->entry != -1)
+            cache.image_used++;
+        islot->id = image.id;
+        islot->entry = entry;
+        cache.stats.misses++;
+        cache.stats.textures++;
+    }
+    file_unload(&file);
+    if (slot->entry != -1)
+        cache.path_used++;
+    slot->path = key;
+    slot->hash = hash;
+    slot->entry = entry;
+    
+found:
+    if (!cache.entries[entry].resident && !cache_reload(entry))
+        return invalid;
+    e = &cache.entries[entry];
+    e->refs++;
+    cache_stamp(e);
+    if (width)
+        *width = e->w;
+    if (height)
+        *height = e->h;
+    return e->image;
+}
+
+void jeff_img_cache_release(sg_image image) {
+    CacheImage *slot;
+    CacheEntry *e;
+    if (!cache.image_slots || !(slot = cache_image_slot(image))->id)
+        return;
+    e = &cache.entries[slot->entry];
+    if (e->refs <= 0 || --e->refs)
+        return;
+    if (!cache.budget)
+        cache_remove(slot->entry);
+    else {
+        cache_stamp(e);
+        cache_trim(0);
+    }
+}
+
+void jeff_img_cache_budget(size_t bytes) {
+    cache.budget = bytes;
+    if (bytes) {
+        cache_trim(0);
+        return;
+    }
+    // Back to destroying textures once they're released.
+    for (int i = 0; i < cache.entry_count; i++)
+        if (cache.entries[i].image.id != SG_INVALID_ID && !cache.entries[i].refs)
+            cache_remove(i);
+}
+
+void jeff_img_cache_keep_files(int enabled) {
+    cache.keep_files = enabled;
+}
+
+void jeff_img_cache_frame(void) {
+    cache.frame++;
+    cache_trim(0);
+}
+
+void jeff_img_cache_content_hash(int enabled) {
+    cache.content_hash = enabled;
+}
+
+void jeff_img_cache_get_stats(jeff_img_cache_stats *stats) {
+    *stats = cache.stats;
+}
+
+void jeff_img_cache_clear(void) {
+    for (int i = 0; i < cache.entry_count; i++) {
+        if (cache.entries[i].image.id == SG_INVALID_ID)
+            continue;
+        sg_destroy_image(cache.entries[i].image);
+        free(cache.entries[i].file);
+        free(cache.entries[i].copy);
+    }
+    for (int i = 0; i < cache.path_slots; i++)
+        free(cache.paths[i].path);
+    free(cache.entries);
+    free(cache.paths);
+    free(cache.images);
+    int content_hash = cache.content_hash, keep_files = cache.keep_files;
+    size_t budget = cache.budget;
+    memset(&cache, 0, sizeof(cache));
+    cache.content_hash = content_hash;
+    cache.keep_files = keep_files;
+    cache.budget = budget;
+}
 #endif
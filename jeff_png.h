@@ -35,6 +35,8 @@ extern "C" {
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
 #include <setjmp.h>
 #include <errno.h>
 
@@ -48,25 +50,275 @@ sg_image sg_load_texture_memory(unsigned char *data, int data_size);
 sg_image sg_load_texture_path_ex(const char *path, int *width, int *height);
 sg_image sg_load_texture_memory_ex(unsigned char *data, int data_size, int *width, int *height);
 
+// Called with each row of RGBA pixels as soon as it's decoded, return 0 to abort
+typedef int (*jeff_png_row_cb)(void *userdata, int y, const int *pixels, int width);
+// Decode a png a row at a time, only the inflate window and a few rows are kept
+// in memory (interlaced images have to be decoded whole first). Returns 0 if
+// the image is invalid or the callback aborted.
+int jeff_png_decode_rows(unsigned char *data, int data_size, jeff_png_row_cb cb, void *userdata, int *width, int *height);
+
+// Bytes needed for the RGBA pixels, read from the header. Returns 0 if the
+// data doesn't look like an image that can be loaded.
+size_t jeff_img_size(unsigned char *data, int data_size, int *width, int *height);
+// Decode RGBA pixels straight into `pixels`, starting each row `pitch` bytes
+// after the last. `pitch` is at least width * 4 and a multiple of 4.
+int jeff_img_load_into(unsigned char *data, int data_size, void *pixels, int pitch);
+// jeff_img_load_into for just the `width` x `height` pixels at `x`, `y`, see
+// jeff_png_decoder_region
+int jeff_png_load_region(unsigned char *data, int data_size, int x, int y, int width, int height, void *pixels, int pitch);
+
+typedef struct {
+    int width, height;
+    int depth;           // bits per sample
+    int color_type;      // 0 grey, 2 RGB, 3 palette, 4 grey + alpha, 6 RGBA
+    int interlaced;
+    int palette_size;    // PLTE entries, 0 if there's none (or it wasn't in the data)
+    int transparency;    // has a tRNS chunk
+    size_t image_bytes;  // decoded RGBA pixels
+    size_t inflate_bytes;  // filtered data to inflate and unfilter, roughly the decode time
+    size_t scratch_bytes;  // working memory needed besides the image
+    sg_pixel_format native_format;  // format with JEFF_PNG_NATIVE
+    size_t native_bytes;            // decoded pixels in that format
+} jeff_png_info;
+
+// Read what's known about a png from its header without decoding anything,
+// the first few hundred bytes of the file are enough. Returns 0 if it isn't
+// a valid png header.
+int jeff_png_probe(const unsigned char *data, int data_size, jeff_png_info *info);
+
+// Keeps hold of the memory used for decoding so it can be used again, after
+// the first few images decoding a batch of similar pngs doesn't allocate. It
+// also keeps the thread that decodes half of an iDOT image once it's started.
+typedef struct jeff_png_decoder jeff_png_decoder;
+jeff_png_decoder* jeff_png_decoder_new(void);
+void jeff_png_decoder_free(jeff_png_decoder *dec);
+// Keep grey as R8 (RG8 if it has a tRNS chunk), grey + alpha as RG8 and
+// 16-bit images as R16/RG16/RGBA16 rather than widening everything to RGBA8.
+// Doesn't apply to jeff_png_decoder_rows.
+#define JEFF_PNG_NATIVE 1
+// With JEFF_PNG_NATIVE, 16-bit images come out in the matching 8-bit format
+// instead of R16/RG16/RGBA16. They're always 8-bit without it.
+#define JEFF_PNG_8BIT 2
+// Check the CRC-32 of every chunk and the Adler-32 of the image data, a png
+// that fails either is rejected. iDOT segments are decoded on one thread.
+#define JEFF_PNG_VERIFY 4
+void jeff_png_decoder_flags(jeff_png_decoder *dec, int flags);
+// What failed the last JEFF_PNG_VERIFY check, naming the chunk and its
+// offset, or NULL if nothing did
+const char* jeff_png_decoder_error(jeff_png_decoder *dec);
+// Pixel format of the last image the decoder loaded
+sg_pixel_format jeff_png_decoder_format(jeff_png_decoder *dec);
+// Called after each Adam7 pass of an interlaced png with the whole image so
+// far, every pixel decoded fills the block it stands for until later passes
+// fill in the rest. Pass 7 is the finished image. Return 0 to stop decoding.
+typedef int (*jeff_png_pass_cb)(void *userdata, int pass, const void *pixels, int width, int height, int pitch);
+void jeff_png_decoder_progressive(jeff_png_decoder *dec, jeff_png_pass_cb cb, void *userdata);
+// Decode at 1/2, 1/4 or 1/8 of the size (`scale` 2, 4 or 8, 1 for full size),
+// every pixel is the average of the block it covers and the image is
+// (width + scale - 1) / scale wide. The full size image is never kept unless
+// it's interlaced, progressive callbacks still see it at full size.
+void jeff_png_decoder_scale(jeff_png_decoder *dec, int scale);
+// Same as load_texture_data but the pixels belong to the decoder, they are
+// only valid until the decoder is used again. Returns NULL on failure.
+const void* jeff_png_decoder_load(jeff_png_decoder *dec, unsigned char *data, int data_size, int *width, int *height);
+// jeff_png_decode_rows with the decoder's memory
+int jeff_png_decoder_rows(jeff_png_decoder *dec, unsigned char *data, int data_size, jeff_png_row_cb cb, void *userdata, int *width, int *height);
+// jeff_img_load_into with the decoder's memory, `pitch` is in bytes of the
+// decoder's pixel format (see jeff_png_info.native_format)
+int jeff_png_decoder_load_into(jeff_png_decoder *dec, unsigned char *data, int data_size, void *pixels, int pitch);
+// Decode the `width` x `height` pixels at `x`, `y` into `pixels` in the
+// decoder's pixel format, starting each row `pitch` bytes after the last.
+// Rows above the region are only unfiltered and nothing after it is inflated.
+// It's always full size, the decoder's scale doesn't apply. Returns 0 if the
+// region isn't inside the image.
+int jeff_png_decoder_region(jeff_png_decoder *dec, unsigned char *data, int data_size, int x, int y, int width, int height, void *pixels, int pitch);
+// Decode into a new texture in the decoder's pixel format
+sg_image jeff_png_decoder_texture(jeff_png_decoder *dec, unsigned char *data, int data_size, int *width, int *height);
+
+// Animated pngs (APNG) are decoded a frame at a time onto an RGBA canvas the
+// size of the image, so an animation of any length uses the same memory. A
+// png without an acTL chunk is an animation of one frame. `data` has to stay
+// around until jeff_apng_close. Returns NULL if it can't be decoded.
+typedef struct jeff_apng jeff_apng;
+jeff_apng* jeff_apng_open(unsigned char *data, int data_size, int *width, int *height, int *frames);
+void jeff_apng_close(jeff_apng *apng);
+// Times to play the animation, 0 to loop forever
+int jeff_apng_plays(jeff_apng *apng);
+// Draw the next frame, after the last it starts again from the first. Returns
+// the canvas and how long to show it for in seconds, or NULL on failure.
+const void* jeff_apng_next(jeff_apng *apng, float *delay);
+// jeff_apng_next into `texture`, a stream texture the size of the animation
+// from sg_empty_texture. It can only be updated once per frame.
+int jeff_apng_update(jeff_apng *apng, sg_image texture, float *delay);
+// Every frame as a layer of an array texture, this one has all of them in
+// memory at once. `delays` gets each frame's delay if it's given.
+sg_image jeff_apng_texture_array(jeff_apng *apng, float *delays);
+
+// Encode `pixels` as a png, rows start `pitch` bytes apart (0 if they're
+// packed). Takes any format the decoder gives out: RGBA8, R8, RG8 and their
+// 16-bit versions in host order. Opaque RGBA8 is written as RGB. `level` 0
+// stores everything unfiltered. From 1 to 9 the search for matches goes
+// further back, each level is slower and usually smaller than the one
+// before, though on some images neighbouring levels swap places.
+// Returns the file, which has to be freed, and its size, or NULL on failure.
+void* jeff_png_encode(const void *pixels, int width, int height, int pitch, sg_pixel_format format, int level, size_t *size);
+// jeff_png_encode to a file, returns 0 on failure
+int jeff_png_save(const char *path, const void *pixels, int width, int height, int pitch, sg_pixel_format format, int level);
+
 #if defined(__cplusplus)
 }
 #endif
 #endif // JEFF_INPUT
 
 #ifdef JEFF_IMPL
-sg_image sg_empty_texture(int width, int height) {
+#ifndef _WIN32
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+
+// SIMD unfilter kernels and checksums, define JEFF_PNG_NO_SIMD to only use
+// the scalar path
+#ifndef JEFF_PNG_NO_SIMD
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define JEFF_PNG_SSE2
+#include <emmintrin.h>
+#if defined(__SSSE3__)
+#include <tmmintrin.h>
+#endif
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define JEFF_PNG_NEON
+#include <arm_neon.h>
+#endif
+// CRC-32 with carry-less multiplies or the ARMv8 CRC instructions
+#if defined(JEFF_PNG_SSE2) && defined(__PCLMUL__)
+#define JEFF_PNG_CLMUL
+#include <wmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#define JEFF_PNG_ARM_CRC
+#include <arm_acle.h>
+#endif
+#endif
+
+// Images split into iDOT segments are decoded on a worker thread kept by the
+// decoder, define JEFF_PNG_NO_THREADS to always decode on the calling thread
+#ifndef JEFF_PNG_NO_THREADS
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+#endif
+
+static sg_image empty_texture(int width, int height, sg_pixel_format format) {
     assert(width && height);
     sg_image_desc desc = {
         .width = width,
         .height = height,
-        .pixel_format = SG_PIXELFORMAT_RGBA8,
+        .pixel_format = format,
         .usage = SG_USAGE_STREAM
     };
     return sg_make_image(&desc);
 }
 
-static int does_file_exist(const char *path) {
-    return !access(path, F_OK);
+sg_image sg_empty_texture(int width, int height) {
+    return empty_texture(width, height, SG_PIXELFORMAT_RGBA8);
+}
+
+static int format_bytes(sg_pixel_format format) {
+    switch (format) {
+        case SG_PIXELFORMAT_R8:
+            return 1;
+        case SG_PIXELFORMAT_RG8:
+        case SG_PIXELFORMAT_R16:
+            return 2;
+        case SG_PIXELFORMAT_RGBA16:
+            return 8;
+        default:
+            return 4;
+    }
+}
+
+// Files are mapped rather than read into memory where mmap is available, the
+// decoders read straight from the mapping. Anything that can't be mapped (or
+// everything, with JEFF_PNG_NO_MMAP) is read into a buffer instead.
+typedef struct {
+    unsigned char *data;
+    size_t size;
+    int mapped;
+} FileData;
+
+static int file_load(const char *path, FileData *f) {
+    unsigned char *buf = NULL, *grown;
+    size_t cap, len = 0;
+    FILE *fh;
+    long sz;
+    int c, ok;
+    f->mapped = 0;
+#if !defined(_WIN32) && !defined(JEFF_PNG_NO_MMAP)
+    struct stat st;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+        int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+        flags |= MAP_POPULATE;
+#endif
+        void *p = mmap(NULL, (size_t)st.st_size, PROT_READ, flags, fd, 0);
+        if (p != MAP_FAILED) {
+#ifdef MADV_SEQUENTIAL
+            madvise(p, (size_t)st.st_size, MADV_SEQUENTIAL);
+#endif
+            close(fd);
+            f->data = p;
+            f->size = (size_t)st.st_size;
+            f->mapped = 1;
+            return 1;
+        }
+    }
+    close(fd);
+#endif
+    
+    if (!(fh = fopen(path, "rb")))
+        return 0;
+    cap = !fseek(fh, 0, SEEK_END) && (sz = ftell(fh)) > 0 ? (size_t)sz : 4096;
+    fseek(fh, 0, SEEK_SET);
+    // Pipes and the like don't know their size, so keep growing to the end.
+    while ((grown = realloc(buf, cap))) {
+        buf = grown;
+        len += fread(buf + len, 1, cap - len, fh);
+        if (len < cap || (c = fgetc(fh)) == EOF || ungetc(c, fh) == EOF)
+            break;
+        cap += cap / 2;
+    }
+    ok = grown && len && !ferror(fh);
+    fclose(fh);
+    if (!ok) {
+        free(buf);
+        return 0;
+    }
+    f->data = buf;
+    f->size = len;
+    return 1;
+}
+
+static void file_unload(FileData *f) {
+#if !defined(_WIN32) && !defined(JEFF_PNG_NO_MMAP)
+    if (f->mapped) {
+        munmap(f->data, f->size);
+        return;
+    }
+#endif
+    free(f->data);
+}
+
+// strdup isn't declared by a strict -std=c99 build.
+static char* copy_string(const char *str) {
+    size_t len = strlen(str) + 1;
+    char *copy = malloc(len);
+    return copy ? memcpy(copy, str, len) : NULL;
 }
 
 static const char* file_extension(const char *path) {
@@ -75,12 +327,9 @@ static const char* file_extension(const char *path) {
 }
 
 sg_image sg_load_texture_path_ex(const char *path, int *width, int *height) {
-    if (!does_file_exist(path))
-        return (sg_image){.id=SG_INVALID_ID};
-    
     const char *ext = file_extension(path);
     unsigned long ext_length = strlen(ext);
-    char *dup = strdup(ext);
+    char *dup = copy_string(ext);
     for (int i = 0; i < ext_length; i++)
         if (dup[i] >= 'A' && dup[i] <= 'Z')
             dup[i] += 32;
@@ -89,41 +338,48 @@ sg_image sg_load_texture_path_ex(const char *path, int *width, int *height) {
     if (match)
         return (sg_image){.id=SG_INVALID_ID};
     
-    size_t sz = -1;
-    FILE *fh = fopen(path, "rb");
-    assert(fh);
-    fseek(fh, 0, SEEK_END);
-    sz = ftell(fh);
-    fseek(fh, 0, SEEK_SET);
-    
-    unsigned char *data = malloc(sz * sizeof(unsigned char));
-    fread(data, sz, 1, fh);
-    fclose(fh);
-    sg_image result = sg_load_texture_memory_ex(data, (int)sz, width, height);
-    free(data);
+    FileData file;
+    if (!file_load(path, &file))
+        return (sg_image){.id=SG_INVALID_ID};
+    if (file.size > INT_MAX) {
+        file_unload(&file);
+        return (sg_image){.id=SG_INVALID_ID};
+    }
+    sg_image result = sg_load_texture_memory_ex(file.data, (int)file.size, width, height);
+    file_unload(&file);
     return result;
 }
 
 typedef struct {
     unsigned int w, h;
     int *buf;
+    int pitch;  // in bytes, when buf is given
+    sg_pixel_format format;
+    unsigned int x, y, rw, rh;  // region to decode, all of it if rw is 0
 } ImageBuffer;
 
 typedef struct {
     const unsigned char *p, *end;
+    // An APNG frame's fcTL, to decode that frame instead of the image. Its
+    // data is in `chunk` chunks after `skip` bytes, IDAT if that's NULL.
+    const unsigned char *frame;
+    const char *chunk;
+    unsigned skip;
 } PNG;
 
 static unsigned get32(const unsigned char *v) {
-    return (v[0] << 24) | (v[1] << 16) | (v[2] << 8) | v[3];
+    return ((unsigned)v[0] << 24) | (v[1] << 16) | (v[2] << 8) | v[3];
 }
 
 static const unsigned char* find(PNG *png, const char *chunk, unsigned minlen) {
     const unsigned char *start;
-    while (png->p < png->end) {
+    while (png->end - png->p >= 12) {
         unsigned len = get32(png->p + 0);
+        if (len > (size_t)(png->end - png->p) - 12)
+            break;  // truncated
         start = png->p;
         png->p += len + 12;
-        if (memcmp(start + 4, chunk, 4) == 0 && len >= minlen && png->p <= png->end)
+        if (memcmp(start + 4, chunk, 4) == 0 && len >= minlen)
             return start + 8;
     }
     return NULL;
@@ -140,128 +396,366 @@ static int rowBytes(int w, int bipp) {
     return rowBits / 8 + ((rowBits % 8) ? 1 : 0);
 }
 
-static int unfilter(int w, int h, int bipp, unsigned char *raw) {
-    int len = rowBytes(w, bipp);
-    int bpp = rowBytes(1, bipp);
-    int x, y;
-    unsigned char *first = (unsigned char*)malloc(len + 1);
-    memset(first, 0, len + 1);
-    unsigned char *prev = first;
-    for (y = 0; y < h; y++, prev = raw, raw += len) {
+static void put32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+#if defined(JEFF_PNG_SSE2)
+// Pixels are moved through the low lanes of a register 3, 4, 6 or 8 bytes
+// at a time.
+static __m128i load_px(const unsigned char *p, int bpp) {
+    int v;
+    switch (bpp) {
+        case 8:
+            return _mm_loadl_epi64((const __m128i*)p);
+        case 6:
+            memcpy(&v, p, 4);
+            return _mm_or_si128(_mm_cvtsi32_si128(v), _mm_slli_si128(_mm_cvtsi32_si128(p[4] | (p[5] << 8)), 4));
+        case 4:
+            memcpy(&v, p, 4);
+            break;
+        default:
+            v = p[0] | (p[1] << 8) | (p[2] << 16);
+    }
+    return _mm_cvtsi32_si128(v);
+}
+
+static void store_px(unsigned char *p, __m128i v, int bpp) {
+    int t = _mm_cvtsi128_si32(v);
+    switch (bpp) {
+        case 8:
+            _mm_storel_epi64((__m128i*)p, v);
+            break;
+        case 6:
+            memcpy(p, &t, 4);
+            t = _mm_cvtsi128_si32(_mm_srli_si128(v, 4));
+            p[4] = (unsigned char)t;
+            p[5] = (unsigned char)(t >> 8);
+            break;
+        case 4:
+            memcpy(p, &t, 4);
+            break;
+        default:
+            p[0] = (unsigned char)t;
+            p[1] = (unsigned char)(t >> 8);
+            p[2] = (unsigned char)(t >> 16);
+    }
+}
+
+static __m128i abs16(__m128i x) {
+#if defined(__SSSE3__)
+    return _mm_abs_epi16(x);
+#else
+    return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+#endif
+}
+
+static __m128i select16(__m128i mask, __m128i a, __m128i b) {
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+static void unfilter_up(unsigned char *raw, const unsigned char *prev, int len) {
+    int x;
+    for (x = 0; x + 16 <= len; x += 16)
+        _mm_storeu_si128((__m128i*)(raw + x), _mm_add_epi8(_mm_loadu_si128((const __m128i*)(raw + x)),
+                                                             _mm_loadu_si128((const __m128i*)(prev + x))));
+    for (; x < len; x++)
+        raw[x] += prev[x];
+}
+
+static void unfilter_sub(unsigned char *raw, int len, int bpp) {
+    __m128i a = _mm_setzero_si128();
+    int x;
+    for (x = 0; x < len; x += bpp) {
+        a = _mm_add_epi8(load_px(raw + x, bpp), a);
+        store_px(raw + x, a, bpp);
+    }
+}
+
+static void unfilter_avg(unsigned char *raw, const unsigned char *prev, int len, int bpp) {
+    __m128i a = _mm_setzero_si128(), b, avg;
+    int x;
+    for (x = 0; x < len; x += bpp) {
+        // _mm_avg_epu8 rounds up, PNG wants (a + b) >> 1
+        b = load_px(prev + x, bpp);
+        avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), _mm_set1_epi8(1)));
+        a = _mm_add_epi8(load_px(raw + x, bpp), avg);
+        store_px(raw + x, a, bpp);
+    }
+}
+
+static void unfilter_paeth(unsigned char *raw, const unsigned char *prev, int len, int bpp) {
+    __m128i zero = _mm_setzero_si128(), a = zero, c = zero, b, d, pa, pb, pc, smallest, nearest;
+    int x;
+    for (x = 0; x < len; x += bpp) {
+        // |p - a| = |b - c|, |p - b| = |a - c|, |p - c| = |a + b - 2c|
+        b = _mm_unpacklo_epi8(load_px(prev + x, bpp), zero);
+        pa = _mm_sub_epi16(b, c);
+        pb = _mm_sub_epi16(a, c);
+        pc = abs16(_mm_add_epi16(pa, pb));
+        pa = abs16(pa);
+        pb = abs16(pb);
+        smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+        nearest = select16(_mm_cmpeq_epi16(smallest, pa), a,
+                           select16(_mm_cmpeq_epi16(smallest, pb), b, c));
+        d = _mm_add_epi8(load_px(raw + x, bpp), _mm_packus_epi16(nearest, nearest));
+        store_px(raw + x, d, bpp);
+        a = _mm_unpacklo_epi8(d, zero);
+        c = b;
+    }
+}
+#elif defined(JEFF_PNG_NEON)
+static uint8x8_t load_px(const unsigned char *p, int bpp) {
+    uint32_t v;
+    switch (bpp) {
+        case 8:
+            return vld1_u8(p);
+        case 6:
+            memcpy(&v, p, 4);
+            return vreinterpret_u8_u64(vcreate_u64(v | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40));
+        case 4:
+            memcpy(&v, p, 4);
+            break;
+        default:
+            v = p[0] | (p[1] << 8) | (p[2] << 16);
+    }
+    return vreinterpret_u8_u32(vdup_n_u32(v));
+}
+
+static void store_px(unsigned char *p, uint8x8_t v, int bpp) {
+    uint32_t t = vget_lane_u32(vreinterpret_u32_u8(v), 0);
+    switch (bpp) {
+        case 8:
+            vst1_u8(p, v);
+            break;
+        case 6:
+            memcpy(p, &t, 4);
+            p[4] = vget_lane_u8(v, 4);
+            p[5] = vget_lane_u8(v, 5);
+            break;
+        case 4:
+            memcpy(p, &t, 4);
+            break;
+        default:
+            p[0] = (unsigned char)t;
+            p[1] = (unsigned char)(t >> 8);
+            p[2] = (unsigned char)(t >> 16);
+    }
+}
+
+static void unfilter_up(unsigned char *raw, const unsigned char *prev, int len) {
+    int x;
+    for (x = 0; x + 16 <= len; x += 16)
+        vst1q_u8(raw + x, vaddq_u8(vld1q_u8(raw + x), vld1q_u8(prev + x)));
+    for (; x < len; x++)
+        raw[x] += prev[x];
+}
+
+static void unfilter_sub(unsigned char *raw, int len, int bpp) {
+    uint8x8_t a = vdup_n_u8(0);
+    int x;
+    for (x = 0; x < len; x += bpp) {
+        a = vadd_u8(load_px(raw + x, bpp), a);
+        store_px(raw + x, a, bpp);
+    }
+}
+
+static void unfilter_avg(unsigned char *raw, const unsigned char *prev, int len, int bpp) {
+    uint8x8_t a = vdup_n_u8(0);
+    int x;
+    for (x = 0; x < len; x += bpp) {
+        a = vadd_u8(load_px(raw + x, bpp), vhadd_u8(a, load_px(prev + x, bpp)));
+        store_px(raw + x, a, bpp);
+    }
+}
+
+static void unfilter_paeth(unsigned char *raw, const unsigned char *prev, int len, int bpp) {
+    int16x8_t a = vdupq_n_s16(0), c = a, b, pa, pb, pc, smallest, nearest;
+    uint8x8_t d;
+    int x;
+    for (x = 0; x < len; x += bpp) {
+        // |p - a| = |b - c|, |p - b| = |a - c|, |p - c| = |a + b - 2c|
+        b = vreinterpretq_s16_u16(vmovl_u8(load_px(prev + x, bpp)));
+        pa = vsubq_s16(b, c);
+        pb = vsubq_s16(a, c);
+        pc = vabsq_s16(vaddq_s16(pa, pb));
+        pa = vabsq_s16(pa);
+        pb = vabsq_s16(pb);
+        smallest = vminq_s16(pc, vminq_s16(pa, pb));
+        nearest = vbslq_s16(vceqq_s16(smallest, pa), a,
+                            vbslq_s16(vceqq_s16(smallest, pb), b, c));
+        d = vadd_u8(load_px(raw + x, bpp), vmovn_u16(vreinterpretq_u16_s16(nearest)));
+        store_px(raw + x, d, bpp);
+        a = vreinterpretq_s16_u16(vmovl_u8(d));
+        c = b;
+    }
+}
+#endif
+
+static int unfilter_row(int type, unsigned char *raw, const unsigned char *prev, int len, int bpp) {
+    int x;
+#if defined(JEFF_PNG_SSE2) || defined(JEFF_PNG_NEON)
+    if (type == 2) {
+        unfilter_up(raw, prev, len);
+        return 1;
+    }
+    if (bpp >= 3)
+        switch (type) {
+            case 1:
+                unfilter_sub(raw, len, bpp);
+                return 1;
+            case 3:
+                unfilter_avg(raw, prev, len, bpp);
+                return 1;
+            case 4:
+                unfilter_paeth(raw, prev, len, bpp);
+                return 1;
+        }
+#endif
 #define LOOP(A, B)            \
     for (x = 0; x < bpp; x++) \
         raw[x] += A;          \
     for (; x < len; x++)      \
         raw[x] += B;          \
     break
-        switch (*raw++) {
-            case 0:
-                break;
-            case 1:
-                LOOP(0, raw[x - bpp]);
-            case 2:
-                LOOP(prev[x], prev[x]);
-            case 3:
-                LOOP(prev[x] / 2, (raw[x - bpp] + prev[x]) / 2);
-            case 4:
-                LOOP(prev[x], paeth(raw[x - bpp], prev[x], prev[x - bpp]));
-            default:
-                return 0;
-        }
-#undef LOOP
+    switch (type) {
+        case 0:
+            break;
+        case 1:
+            LOOP(0, raw[x - bpp]);
+        case 2:
+            LOOP(prev[x], prev[x]);
+        case 3:
+            LOOP(prev[x] / 2, (raw[x - bpp] + prev[x]) / 2);
+        case 4:
+            LOOP(prev[x], paeth(raw[x - bpp], prev[x], prev[x - bpp]));
+        default:
+            return 0;
     }
-    free(first);
+#undef LOOP
     return 1;
 }
 
-#define RGBA(R, G, B, A) (((uint8_t)(A) << 24) | ((uint8_t)(B) << 16) | ((uint8_t)(G) << 8) | (uint8_t)(R))
+// 16-bit samples are big endian, swap `len` bytes of them to host order.
+static void swap16(const unsigned char *src, unsigned char *dest, int len) {
+    int x = 0;
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    memcpy(dest, src, len);
+    return;
+#elif defined(JEFF_PNG_SSE2)
+    for (; x + 16 <= len; x += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + x));
+        _mm_storeu_si128((__m128i*)(dest + x), _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8)));
+    }
+#elif defined(JEFF_PNG_NEON)
+    for (; x + 16 <= len; x += 16)
+        vst1q_u8(dest + x, vrev16q_u8(vld1q_u8(src + x)));
+#endif
+    for (; x + 1 < len; x += 2) {
+        unsigned char t = src[x];
+        dest[x] = src[x + 1];
+        dest[x + 1] = t;
+    }
+}
+
+// Keep the high byte of `n` 16-bit samples.
+static void narrow16(const unsigned char *src, unsigned char *dest, int n) {
+    int x = 0;
+#if defined(JEFF_PNG_SSE2)
+    __m128i mask = _mm_set1_epi16(0xff);
+    for (; x + 16 <= n; x += 16)
+        _mm_storeu_si128((__m128i*)(dest + x),
+                         _mm_packus_epi16(_mm_and_si128(_mm_loadu_si128((const __m128i*)(src + 2 * x)), mask),
+                                          _mm_and_si128(_mm_loadu_si128((const __m128i*)(src + 2 * x + 16)), mask)));
+#elif defined(JEFF_PNG_NEON)
+    for (; x + 16 <= n; x += 16)
+        vst1q_u8(dest + x, vld2q_u8(src + 2 * x).val[0]);
+#endif
+    for (; x < n; x++)
+        dest[x] = src[2 * x];
+}
+
+#ifdef RGB
+#undef RGB  // wingdi.h
+#endif
+#define RGBA(R, G, B, A) (((uint32_t)(uint8_t)(A) << 24) | ((uint8_t)(B) << 16) | ((uint8_t)(G) << 8) | (uint8_t)(R))
 #define RGBA1(C, A) RGBA((C), (C), (C), (A))
 #define RGB(R, G, B) RGBA((R), (G), (B), 255)
 #define RGB1(C) RGBA1((C), 255)
 
-static void convert(int bypp, int w, int h, const unsigned char *src, int *dest, const unsigned char *trns) {
-    int x, y;
-    for (y = 0; y < h; y++) {
-        src++;  // skip filter byte
-        for (x = 0; x < w; x++, src += bypp) {
-            switch (bypp) {
-                case 1: {
-                    unsigned char c = src[0];
-                    if (trns && c == *trns) {
-                        *dest++ = RGBA1(c, 0);
-                        break;
-                    } else {
-                        *dest++ = RGB1(c);
-                        break;
-                    }
-                }
-                case 2:
-                    *dest++ = RGBA(src[0], src[0], src[0], src[1]);
+static void convert(int bypp, int w, const unsigned char *src, int *dest, const unsigned char *trns) {
+    int x;
+    for (x = 0; x < w; x++, src += bypp) {
+        switch (bypp) {
+            case 1: {
+                unsigned char c = src[0];
+                if (trns && c == trns[1]) {
+                    *dest++ = RGBA1(c, 0);
+                    break;
+                } else {
+                    *dest++ = RGB1(c);
                     break;
-                case 3: {
-                    unsigned char r = src[0];
-                    unsigned char g = src[1];
-                    unsigned char b = src[2];
-                    if (trns && trns[1] == r && trns[3] == g && trns[5] == b) {
-                        *dest++ = RGBA(r, g, b, 0);
-                        break;
-                    } else {
-                        *dest++ = RGB(r, g, b);
-                        break;
-                    }
                 }
-                case 4:
-                    *dest++ = RGBA(src[0], src[1], src[2], src[3]);
+            }
+            case 2:
+                *dest++ = RGBA(src[0], src[0], src[0], src[1]);
+                break;
+            case 3: {
+                unsigned char r = src[0];
+                unsigned char g = src[1];
+                unsigned char b = src[2];
+                if (trns && trns[1] == r && trns[3] == g && trns[5] == b) {
+                    *dest++ = RGBA(r, g, b, 0);
                     break;
+                } else {
+                    *dest++ = RGB(r, g, b);
+                    break;
+                }
             }
+            case 4:
+                *dest++ = RGBA(src[0], src[1], src[2], src[3]);
+                break;
         }
     }
 }
 
-static void depalette(int w, int h, unsigned char *src, int *dest, int bipp, const unsigned char *plte, const unsigned char *trns, int trnsSize) {
-    int x, y, c;
-    unsigned char alpha;
-    int mask = 0, len = 0;
+// Copies `per` pixels out of the expansion table for each source byte. It's
+// inlined with a constant `per`, so every byte is one fixed size copy.
+static inline void expand_bytes(int *dest, const unsigned char *src, const uint32_t *expand, int w, int per) {
+    int x;
+    for (x = 0; x + per <= w; x += per)
+        memcpy(dest + x, expand + *src++ * per, per * sizeof(int));
+    if (x < w)
+        memcpy(dest + x, expand + *src * per, (w - x) * sizeof(int));
+}
 
+static void depalette(int w, const unsigned char *src, int *dest, int bipp, const uint32_t *lut) {
+    int x;
     switch (bipp) {
+        case 8:
+            for (x = 0; x + 4 <= w; x += 4) {
+                dest[x + 0] = lut[src[x + 0]];
+                dest[x + 1] = lut[src[x + 1]];
+                dest[x + 2] = lut[src[x + 2]];
+                dest[x + 3] = lut[src[x + 3]];
+            }
+            for (; x < w; x++)
+                dest[x] = lut[src[x]];
+            break;
         case 4:
-            mask = 15;
-            len = 1;
+            expand_bytes(dest, src, lut + 256, w, 2);
             break;
         case 2:
-            mask = 3;
-            len = 3;
+            expand_bytes(dest, src, lut + 256, w, 4);
             break;
         case 1:
-            mask = 1;
-            len = 7;
-    }
-
-    for (y = 0; y < h; y++) {
-        src++;  // skip filter byte
-        for (x = 0; x < w; x++) {
-            if (bipp == 8) {
-                c = *src++;
-            } else {
-                int pos = x & len;
-                c = (src[0] >> ((len - pos) * bipp)) & mask;
-                if (pos == len) {
-                    src++;
-                }
-            }
-            alpha = 255;
-            if (c < trnsSize) {
-                alpha = trns[c];
-            }
-            *dest++ = RGBA(plte[c * 3 + 0], plte[c * 3 + 1], plte[c * 3 + 2], alpha);
-        }
+            expand_bytes(dest, src, lut + 256, w, 8);
     }
 }
 
-static int outsize(ImageBuffer *img, int bipp) {
-    return (rowBytes(img->w, bipp) + 1) * img->h;
-}
-
 #define PNG_FAIL()      \
     {                   \
         errno = EINVAL; \
@@ -271,13 +765,91 @@ static int outsize(ImageBuffer *img, int bipp) {
     if (!(X))        \
         PNG_FAIL()
 
+// Huffman lookup tables. The first (1 << *_BITS) entries are indexed by the
+// next bits of input; codes longer than that link to a second-level table.
+// *_ENOUGH is the worst case size of both levels (see zlib's `enough`).
+#define LIT_BITS 9
+#define LIT_ENOUGH 852
+#define DIST_BITS 6
+#define DIST_ENOUGH 592
+#define LEN_BITS 7
+#define LEN_ENOUGH 128
+
+// Output goes through a buffer that keeps the last WINDOW bytes for back
+// references, every complete row of `rowlen` bytes is handed to `row`. It
+// returns the length of the row after, 0 to stop with an error or -1 when it
+// doesn't need any more.
+#define WINDOW 32768
+
+typedef int (*RowFunc)(void *user, const unsigned char *row);
+
+typedef struct {
+    void *ptr;
+    size_t size;
+} Arena;
+
+// Scratch memory that only grows, the contents aren't kept when it does.
+static void* arena(Arena *a, size_t size) {
+    if (a->size < size) {
+        free(a->ptr);
+        a->size = (a->ptr = malloc(size)) ? size : 0;
+    }
+    return a->ptr;
+}
+
+#define MAX_SEGMENTS 2
+
+#ifndef JEFF_PNG_NO_THREADS
+// Decodes one iDOT segment at a time, `job` is the Segment it's been given
+// until it's done. Started the first time it's needed and stopped when the
+// decoder is freed, so a decoder that's reused only starts it once.
+typedef struct {
+#ifdef _WIN32
+    HANDLE thread;
+    CRITICAL_SECTION lock;
+    CONDITION_VARIABLE work, done;
+#else
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t work, done;
+#endif
+    int running;
+    void *job;
+} Worker;
+#endif
+
+struct jeff_png_decoder {
+    Arena state[MAX_SEGMENTS];  // inflate state and window
+    Arena rows[MAX_SEGMENTS];   // filter context
+    Arena held[MAX_SEGMENTS];   // rows waiting on the segment above
+    Arena image;
+    Arena palette;              // colour lookup tables
+    Arena full;                 // interlaced image before it's scaled down
+    char error[64];
+    int flags, scale;
+    sg_pixel_format format;
+    jeff_png_pass_cb progress;
+    void *progressData;
+#ifndef JEFF_PNG_NO_THREADS
+    Worker workers[MAX_SEGMENTS - 1];  // for every segment but the first
+#endif
+};
+
 typedef struct {
-    unsigned bits, count;
+    uint64_t bits;
+    int count;
     const unsigned char *in, *inend;
-    unsigned char *out, *outend;
+    PNG *idat;
+    unsigned char *out, *outstart, *outend;
+    unsigned char *rowstart;
+    unsigned char *summed;  // output up to here is in `adler`
+    uint32_t adler;
+    int verify;
+    int rowlen, rows;
+    RowFunc row;
+    void *user;
     jmp_buf jmp;
-    unsigned litcodes[288], distcodes[32], lencodes[19];
-    int tlit, tdist, tlen;
+    unsigned short litcodes[LIT_ENOUGH], distcodes[DIST_ENOUGH], lencodes[LEN_ENOUGH];
 } State;
 
 #define INFLATE_FAIL() longjmp(s->jmp, 1)
@@ -309,90 +881,406 @@ static unsigned rev16(unsigned n) {
     return (reverseTable[n & 0xff] << 8) | reverseTable[(n >> 8) & 0xff];
 }
 
+static uint64_t load64le(const unsigned char *p) {
+    uint64_t v;
+    memcpy(&v, p, 8);
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+static void store64le(unsigned char *p, uint64_t v) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    memcpy(p, &v, 8);
+}
+
+// Slice-by-8 CRC-32 tables, the first is the usual byte at a time one and
+// each one after it is for a byte further back. They're shared by everything
+// and built once, the first time crc_ready is called.
+static uint32_t crc_table[8][256];
+
+static void crc_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c >> 1) ^ (0xedb88320u & (0u - (c & 1)));
+        crc_table[0][i] = c;
+    }
+    for (int k = 1; k < 8; k++)
+        for (int i = 0; i < 256; i++)
+            crc_table[k][i] = (crc_table[k - 1][i] >> 8) ^ crc_table[0][crc_table[k - 1][i] & 0xff];
+}
+
+#if !defined(JEFF_PNG_NO_THREADS) && defined(_WIN32)
+static BOOL CALLBACK crc_init_once(PINIT_ONCE once, PVOID arg, PVOID *context) {
+    (void)once;
+    (void)arg;
+    (void)context;
+    crc_init();
+    return TRUE;
+}
+#endif
+
+static void crc_ready(void) {
+#if defined(JEFF_PNG_NO_THREADS)
+    static int ready = 0;
+    if (!ready) {
+        crc_init();
+        ready = 1;
+    }
+#elif defined(_WIN32)
+    static INIT_ONCE once = INIT_ONCE_STATIC_INIT;
+    InitOnceExecuteOnce(&once, crc_init_once, NULL, NULL);
+#else
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, crc_init);
+#endif
+}
+
+#if defined(JEFF_PNG_CLMUL)
+// Folds 64 bytes at a time with carry-less multiplies, then down to 16 and
+// Barrett reduces what's left (Intel's "Fast CRC Computation for Generic
+// Polynomials Using PCLMULQDQ"). `n` is a multiple of 16, at least 64, and
+// `crc` isn't inverted.
+static uint32_t crc_clmul(uint32_t crc, const unsigned char *p, size_t n) {
+    const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+    const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+    const __m128i k5 = _mm_set_epi64x(0, 0x0163cd6124);
+    const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+    const __m128i mask = _mm_setr_epi32(-1, 0, -1, 0);
+    __m128i x1 = _mm_xor_si128(_mm_loadu_si128((const __m128i*)p), _mm_cvtsi32_si128(crc));
+    __m128i x2 = _mm_loadu_si128((const __m128i*)(p + 16));
+    __m128i x3 = _mm_loadu_si128((const __m128i*)(p + 32));
+    __m128i x4 = _mm_loadu_si128((const __m128i*)(p + 48));
+    __m128i t;
+#define FOLD(X, K, D)                                \
+    t = _mm_clmulepi64_si128(X, K, 0x00);            \
+    X = _mm_xor_si128(_mm_clmulepi64_si128(X, K, 0x11), \
+                      _mm_xor_si128(t, D))
+    for (p += 64, n -= 64; n >= 64; p += 64, n -= 64) {
+        FOLD(x1, k1k2, _mm_loadu_si128((const __m128i*)p));
+        FOLD(x2, k1k2, _mm_loadu_si128((const __m128i*)(p + 16)));
+        FOLD(x3, k1k2, _mm_loadu_si128((const __m128i*)(p + 32)));
+        FOLD(x4, k1k2, _mm_loadu_si128((const __m128i*)(p + 48)));
+    }
+    FOLD(x1, k3k4, x2);
+    FOLD(x1, k3k4, x3);
+    FOLD(x1, k3k4, x4);
+    for (; n >= 16; p += 16, n -= 16) {
+        FOLD(x1, k3k4, _mm_loadu_si128((const __m128i*)p));
+    }
+#undef FOLD
+    // 128 bits to 64, then to 32
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, mask), k5, 0x00), x2);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, mask), poly, 0x10);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, mask), poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return (uint32_t)_mm_cvtsi128_si32(_mm_srli_si128(x1, 4));
+}
+#endif
+
+// CRC-32 of a png chunk's type and data, after crc_ready
+static uint32_t crc_update(uint32_t crc, const unsigned char *p, size_t n) {
+    const uint32_t (*table)[256] = crc_table;
+    crc = ~crc;
+#if defined(JEFF_PNG_ARM_CRC)
+    for (; n >= 8; p += 8, n -= 8)
+        crc = __crc32d(crc, load64le(p));
+#else
+#if defined(JEFF_PNG_CLMUL)
+    if (n >= 64) {
+        size_t k = n & ~(size_t)15;
+        crc = crc_clmul(crc, p, k);
+        p += k;
+        n -= k;
+    }
+#endif
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t v = load64le(p) ^ crc;
+        crc = table[7][v & 0xff] ^ table[6][(v >> 8) & 0xff] ^ table[5][(v >> 16) & 0xff] ^ table[4][(v >> 24) & 0xff]
+            ^ table[3][(v >> 32) & 0xff] ^ table[2][(v >> 40) & 0xff] ^ table[1][(v >> 48) & 0xff] ^ table[0][v >> 56];
+    }
+#endif
+    while (n--)
+        crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+// Adler-32 of the zlib stream's inflated data, 5552 bytes is as many as can
+// be summed before `b` could overflow. With SSE2 each 16 bytes adds their
+// sum to `a`, and to `b` 16 times the `a` before them plus each byte
+// weighted by how many are left after it.
+static uint32_t adler_update(uint32_t adler, const unsigned char *p, size_t n) {
+    uint32_t a = adler & 0xffff, b = adler >> 16;
+    while (n) {
+        size_t k = n < 5552 ? n : 5552;
+        n -= k;
+#if defined(JEFF_PNG_SSE2)
+        if (k >= 16) {
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i hi = _mm_setr_epi16(16, 15, 14, 13, 12, 11, 10, 9);
+            const __m128i lo = _mm_setr_epi16(8, 7, 6, 5, 4, 3, 2, 1);
+            __m128i sa = zero, prior = zero, sb = zero;
+            size_t blocks = k / 16;
+            uint32_t v[4];
+            for (size_t i = 0; i < blocks; i++, p += 16) {
+                __m128i x = _mm_loadu_si128((const __m128i*)p);
+                prior = _mm_add_epi32(prior, sa);
+                sa = _mm_add_epi32(sa, _mm_sad_epu8(x, zero));
+                sb = _mm_add_epi32(sb, _mm_add_epi32(_mm_madd_epi16(_mm_unpacklo_epi8(x, zero), hi),
+                                                     _mm_madd_epi16(_mm_unpackhi_epi8(x, zero), lo)));
+            }
+            // 16 times the sums before each block can pass 32 bits
+            uint64_t sum = b + (uint64_t)a * 16 * blocks;
+            _mm_storeu_si128((__m128i*)v, prior);
+            sum += ((uint64_t)v[0] + v[2]) * 16;
+            _mm_storeu_si128((__m128i*)v, sb);
+            sum += (uint64_t)v[0] + v[1] + v[2] + v[3];
+            _mm_storeu_si128((__m128i*)v, sa);
+            a += v[0] + v[2];
+            b = sum % 65521;
+            k -= blocks * 16;
+        }
+#endif
+        while (k--) {
+            a += *p++;
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
+
+// Input is read straight out of the file, one IDAT chunk at a time.
+static int next_chunk(State *s) {
+    const unsigned char *idat;
+    unsigned skip = s->idat->skip;
+    do {
+        if (!(idat = find(s->idat, s->idat->chunk ? s->idat->chunk : "IDAT", skip)))
+            return 0;
+        s->in = idat + skip;
+        s->inend = idat + get32(idat - 8);
+    } while (s->in == s->inend);
+    return 1;
+}
+
+static void refill(State *s) {
+    if (s->inend - s->in >= 8) {
+        // Top up to 56+ bits with a single load. The partial byte left above
+        // `count` is ORed in again by the next refill, so it does no harm.
+        s->bits |= load64le(s->in) << s->count;
+        s->in += (63 - s->count) >> 3;
+        s->count |= 56;
+    } else {
+        while (s->count <= 56 && (s->in < s->inend || next_chunk(s))) {
+            s->bits |= (uint64_t)*s->in++ << s->count;
+            s->count += 8;
+        }
+    }
+}
+
+static int more(State *s) {
+    return s->count >= 8 || s->in < s->inend || next_chunk(s);
+}
+
 static int bits(State *s, int n) {
-    int v = s->bits & ((1 << n) - 1);
+    int v;
+    if (s->count < n) {
+        refill(s);
+        INFLATE_CHECK(s->count >= n);
+    }
+    v = s->bits & ((1 << n) - 1);
     s->bits >>= n;
     s->count -= n;
-    while (s->count < 16) {
-        INFLATE_CHECK(s->in != s->inend);
-        s->bits |= (*s->in++) << s->count;
-        s->count += 8;
-    }
     return v;
 }
 
+static void drain(State *s) {
+    // Hand out complete rows, anything past the last row is dropped.
+    unsigned char *keep;
+    int next;
+    for (; s->rows && s->out - s->rowstart >= s->rowlen; s->rows--) {
+        INFLATE_CHECK((next = s->row(s->user, s->rowstart)) != 0);
+        if (next < 0)
+            longjmp(s->jmp, 2);
+        s->rowstart += s->rowlen;
+        s->rowlen = next;
+    }
+    if (!s->rows)
+        s->rowstart = s->out;
+    if (s->verify) {
+        s->adler = adler_update(s->adler, s->summed, s->out - s->summed);
+        s->summed = s->out;
+    }
+
+    // Slide the window and any partial row back to the start of the buffer.
+    keep = s->out - s->outstart > WINDOW ? s->out - WINDOW : s->outstart;
+    if (keep > s->rowstart)
+        keep = s->rowstart;
+    memmove(s->outstart, keep, s->out - keep);
+    s->rowstart -= keep - s->outstart;
+    s->out -= keep - s->outstart;
+    s->summed = s->out;
+}
+
 static unsigned char *emit(State *s, int len) {
+    if (s->outend - s->out < len)
+        drain(s);
     s->out += len;
     INFLATE_CHECK(s->out <= s->outend);
     return s->out - len;
 }
 
 static void copy(State *s, const unsigned char *src, int len) {
-    unsigned char *dest = emit(s, len);
-    while (len--)
-        *dest++ = *src++;
+    // Stored blocks can be bigger than the space left, copy in pieces.
+    while (s->outend - s->out < len) {
+        int n = (int)(s->outend - s->out);
+        memcpy(s->out, src, n);
+        s->out += n;
+        src += n;
+        len -= n;
+        drain(s);
+    }
+    memcpy(emit(s, len), src, len);
 }
 
-static int build(State *s, unsigned *tree, unsigned char *lens, int symcount) {
-    int n, codes[16], first[16], counts[16] = { 0 };
+// Back-references are copied in 16 or 32 byte steps and may write up to
+// INFLATE_SLACK bytes past their end, so that path needs that much headroom.
+#define INFLATE_SLACK 32
+
+static void match(State *s, int dist, int len) {
+    // Largest multiple of the distance that fits in 16 bytes.
+    static const unsigned char period[16] = { 0, 16, 16, 15, 16, 15, 12, 14, 16, 9, 10, 11, 12, 13, 14, 15 };
+    unsigned char *dest;
+    const unsigned char *src;
+
+    if (s->outend - s->out < len + INFLATE_SLACK)
+        drain(s);
+    dest = s->out;
+    src = dest - dist;
+    if (s->outend - dest < len + INFLATE_SLACK) {
+        emit(s, len);
+        while (len--)
+            *dest++ = *src++;
+        return;
+    }
+    s->out += len;
+    if (dist >= 32)
+        for (; len > 0; dest += 32, src += 32, len -= 32)
+            memcpy(dest, src, 32);
+    else if (dist >= 16)
+        for (; len > 0; dest += 16, src += 16, len -= 16)
+            memcpy(dest, src, 16);
+    else if (dist == 1)
+        memset(dest, *src, len);
+    else {
+        // Overlapping run, broadcast the pattern and store it a period at a time.
+        unsigned char pattern[16];
+        int i, step = period[dist];
+        for (i = 0; i < 16; i++)
+            pattern[i] = i < dist ? src[i] : pattern[i - dist];
+        for (; len > 0; dest += step, len -= step)
+            memcpy(dest, pattern, 16);
+    }
+}
+
+// Table entries are either a symbol, (sym << 4) | len, or a link to a second
+// level table, 0x8000 | (offset << 4) | bits. An entry of 0 is an unused code.
+static void build(State *s, unsigned short *table, int root, int size, const unsigned char *lens, int symcount) {
+    int n, i, left, used, codes[16], next[16], counts[16] = { 0 };
+    unsigned char longest[1 << LIT_BITS] = { 0 };
 
     // Frequency count.
     for (n = 0; n < symcount; n++)
         counts[lens[n]]++;
 
-    // Distribute codes.
-    counts[0] = codes[0] = first[0] = 0;
-    for (n = 1; n <= 15; n++) {
+    // Reject over-subscribed codes, incomplete ones just leave holes.
+    counts[0] = codes[0] = 0;
+    for (n = 1, left = 1; n <= 15; n++) {
+        left = (left << 1) - counts[n];
+        INFLATE_CHECK(left >= 0);
         codes[n] = (codes[n - 1] + counts[n - 1]) << 1;
-        first[n] = first[n - 1] + counts[n - 1];
     }
-    INFLATE_CHECK(first[15] + counts[15] <= symcount);
+    memset(table, 0, size * sizeof(*table));
 
-    // Insert keys into the tree for each symbol.
+    // Size the second level tables by the longest code under each prefix.
+    memcpy(next, codes, sizeof(next));
     for (n = 0; n < symcount; n++) {
         int len = lens[n];
-        if (len != 0) {
-            int code = codes[len]++, slot = first[len]++;
-            tree[slot] = (code << (32 - len)) | (n << 4) | len;
+        if (len > root) {
+            int idx = rev16(next[len] >> (len - root)) >> (16 - root);
+            if (longest[idx] < len)
+                longest[idx] = len;
         }
+        if (len)
+            next[len]++;
     }
+    for (n = 0, used = 1 << root; n < 1 << root; n++)
+        if (longest[n]) {
+            int sub = longest[n] - root;
+            INFLATE_CHECK(used + (1 << sub) <= size);
+            table[n] = 0x8000 | (used << 4) | sub;
+            used += 1 << sub;
+        }
 
-    return first[15];
-}
-
-static int decode(State *s, unsigned tree[], int max) {
-    // Find the next prefix code.
-    unsigned lo = 0, hi = max, key;
-    unsigned search = (rev16(s->bits) << 16) | 0xffff;
-    while (lo < hi) {
-        unsigned guess = (lo + hi) / 2;
-        if (search < tree[guess])
-            hi = guess;
-        else
-            lo = guess + 1;
+    // Fill every slot whose low bits match each (bit reversed) code.
+    for (n = 0; n < symcount; n++) {
+        int len = lens[n];
+        if (len != 0) {
+            int code = rev16(codes[len]++) >> (16 - len);
+            unsigned short key = (n << 4) | len;
+            if (len <= root)
+                for (i = code; i < 1 << root; i += 1 << len)
+                    table[i] = key;
+            else {
+                unsigned short link = table[code & ((1 << root) - 1)];
+                unsigned short *sub = table + ((link >> 4) & 0x7ff);
+                for (i = code >> root; i < 1 << (link & 15); i += 1 << (len - root))
+                    sub[i] = key;
+            }
+        }
     }
+}
 
-    // Pull out the key and check it.
-    key = tree[lo - 1];
-    INFLATE_CHECK(((search ^ key) >> (32 - (key & 0xf))) == 0);
+static int decode(State *s, const unsigned short *table, int root) {
+    // One lookup for short codes, a second one for the rest.
+    if (s->count < 15)
+        refill(s);
+    unsigned key = table[s->bits & ((1 << root) - 1)];
+    if (key & 0x8000)
+        key = table[((key >> 4) & 0x7ff) + ((s->bits >> root) & ((1 << (key & 15)) - 1))];
+    INFLATE_CHECK(key != 0);
 
     bits(s, key & 0xf);
-    return (key >> 4) & 0xfff;
+    return key >> 4;
 }
 
 static void run(State *s, int sym) {
     int length = bits(s, lenBits[sym]) + lenBase[sym];
-    int dsym = decode(s, s->distcodes, s->tdist);
+    int dsym = decode(s, s->distcodes, DIST_BITS);
     int offs = bits(s, distBits[dsym]) + distBase[dsym];
-    copy(s, s->out - offs, length);
+    INFLATE_CHECK(dsym < 30 && offs <= s->out - s->outstart);
+    match(s, offs, length);
 }
 
 static void block(State *s) {
     for (;;) {
-        int sym = decode(s, s->litcodes, s->tlit);
-        if (sym < 256)
-            *emit(s, 1) = (unsigned char)sym;
-        else if (sym > 256)
+        // Enough bits for a whole length/distance pair.
+        if (s->count < 48)
+            refill(s);
+        int sym = decode(s, s->litcodes, LIT_BITS);
+        if (sym < 256) {
+            if (s->out == s->outend)
+                drain(s);
+            *s->out++ = (unsigned char)sym;
+        } else if (sym > 256)
             run(s, sym - 257);
         else
             break;
@@ -401,15 +1289,24 @@ static void block(State *s) {
 
 static void stored(State *s) {
     // Uncompressed data block.
-    int len;
+    int len, n;
     bits(s, s->count & 7);
     len = bits(s, 16);
-    INFLATE_CHECK(((len ^ s->bits) & 0xffff) == 0xffff);
-    INFLATE_CHECK(s->in + len <= s->inend);
+    INFLATE_CHECK((len ^ bits(s, 16)) == 0xffff);
 
-    copy(s, s->in, len);
-    s->in += len;
-    bits(s, 16);
+    // Whole bytes left in the bit buffer come first, then the rest can be
+    // copied straight from the chunks.
+    for (; len && s->count; len--)
+        *emit(s, 1) = (unsigned char)bits(s, 8);
+    if (s->count)
+        return;
+    s->bits = 0;
+    for (; len; len -= n) {
+        INFLATE_CHECK(s->in < s->inend || next_chunk(s));
+        n = s->inend - s->in < len ? (int)(s->inend - s->in) : len;
+        copy(s, s->in, n);
+        s->in += n;
+    }
 }
 
 static void fixed(State *s) {
@@ -428,12 +1325,12 @@ static void fixed(State *s) {
         lens[288 + n] = 5;
 
     // Build lit/dist trees.
-    s->tlit = build(s, s->litcodes, lens, 288);
-    s->tdist = build(s, s->distcodes, lens + 288, 32);
+    build(s, s->litcodes, LIT_BITS, LIT_ENOUGH, lens, 288);
+    build(s, s->distcodes, DIST_BITS, DIST_ENOUGH, lens + 288, 32);
 }
 
 static void dynamic(State *s) {
-    int n, i, nlit, ndist, nlen;
+    int n, nlit, ndist, nlen;
     unsigned char lenlens[19] = { 0 }, lens[288 + 32];
     nlit = 257 + bits(s, 5);
     ndist = 1 + bits(s, 5);
@@ -442,51 +1339,78 @@ static void dynamic(State *s) {
         lenlens[(unsigned char)order[n]] = (unsigned char)bits(s, 3);
 
     // Build the tree for decoding code lengths.
-    s->tlen = build(s, s->lencodes, lenlens, 19);
+    build(s, s->lencodes, LEN_BITS, LEN_ENOUGH, lenlens, 19);
 
     // Decode code lengths.
     for (n = 0; n < nlit + ndist;) {
-        int sym = decode(s, s->lencodes, s->tlen);
+        int sym = decode(s, s->lencodes, LEN_BITS), len = sym, repeat = 1;
         switch (sym) {
             case 16:
-                for (i = 3 + bits(s, 2); i; i--, n++)
-                    lens[n] = lens[n - 1];
+                INFLATE_CHECK(n > 0);
+                len = lens[n - 1];
+                repeat = 3 + bits(s, 2);
                 break;
             case 17:
-                for (i = 3 + bits(s, 3); i; i--, n++)
-                    lens[n] = 0;
+                len = 0;
+                repeat = 3 + bits(s, 3);
                 break;
             case 18:
-                for (i = 11 + bits(s, 7); i; i--, n++)
-                    lens[n] = 0;
-                break;
-            default:
-                lens[n++] = (unsigned char)sym;
+                len = 0;
+                repeat = 11 + bits(s, 7);
                 break;
         }
+        INFLATE_CHECK(n + repeat <= nlit + ndist);
+        memset(lens + n, len, repeat);
+        n += repeat;
     }
 
     // Build lit/dist trees.
-    s->tlit = build(s, s->litcodes, lens, nlit);
-    s->tdist = build(s, s->distcodes, lens + nlit, ndist);
+    build(s, s->litcodes, LIT_BITS, LIT_ENOUGH, lens, nlit);
+    build(s, s->distcodes, DIST_BITS, DIST_ENOUGH, lens + nlit, ndist);
 }
 
-static int inflate(void *out, unsigned outlen, const void *in, unsigned inlen) {
-    int last;
-    State *s = calloc(1, sizeof(State));
+// `zlib` is 0 for a raw deflate stream that starts partway through the image.
+// `rowlen` is the first row's length and `maxlen` the longest. With `verify`
+// set a zlib stream's Adler-32 is checked too, if that's what fails (or is
+// missing) it's set to -1. It isn't checked if the row function stops early.
+static int inflate(Arena *scratch, PNG *idat, int zlib, int rowlen, int maxlen, int rows, RowFunc row, void *user, int *verify) {
+    int last, cmf, flg, i;
+    // Room for the window, a partial row and plenty to write into after a slide.
+    unsigned size = 2 * WINDOW + maxlen + INFLATE_SLACK;
+    State *s = arena(scratch, sizeof(State) + size);
+    unsigned char *buf;
+    if (!s)
+        return 0;
+    buf = (unsigned char*)(s + 1);
 
-    // We assume we can buffer 2 extra bytes from off the end of 'in'.
-    s->in = (unsigned char*)in;
-    s->inend = s->in + inlen + 2;
-    s->out = (unsigned char*)out;
-    s->outend = s->out + outlen;
+    s->idat = idat;
+    s->in = s->inend = NULL;
+    s->out = s->outstart = s->rowstart = s->summed = buf;
+    s->outend = buf + size;
+    s->rowlen = rowlen;
+    s->rows = rows;
+    s->row = row;
+    s->user = user;
     s->bits = 0;
     s->count = 0;
-    bits(s, 0);
+    s->adler = 1;
+    s->verify = zlib && verify && *verify;
 
-    if (setjmp(s->jmp) == 1) {
-        free(s);
-        return 0;
+    // 2 is the row function saying it's done early.
+    switch (setjmp(s->jmp)) {
+        case 1:
+            return 0;
+        case 2:
+            return 1;
+    }
+
+    if (zlib) {
+        cmf = bits(s, 8);
+        flg = bits(s, 8);
+        INFLATE_CHECK((cmf & 0x0f) == 0x08     // compression method (RFC 1950)
+                  && (cmf & 0xf0) <= 0x70      // window size
+                  && (flg & 0x20) == 0         // preset dictionary present
+                  && (cmf << 8 | flg) % 31 == 0);
     }
 
     do {
@@ -506,128 +1430,1777 @@ static int inflate(void *out, unsigned outlen, const void *in, unsigned inlen) {
             case 3:
                 INFLATE_FAIL();
         }
-    } while (!last);
+    } while (!last && more(s));  // a segment ends at a flush, not a final block
 
-    free(s);
+    // Flush the last rows and make sure there were enough of them.
+    drain(s);
+    INFLATE_CHECK(s->rows == 0);
+    // The trailer comes after the final block, it's missing if that is.
+    if (s->verify) {
+        uint32_t trailer = 0;
+        *verify = -1;
+        INFLATE_CHECK(last);
+        bits(s, s->count & 7);
+        for (i = 0; i < 4; i++)
+            trailer = trailer << 8 | bits(s, 8);
+        INFLATE_CHECK(trailer == s->adler);
+        *verify = 1;
+    }
     return 1;
 }
 
-static void load_png(PNG *png, ImageBuffer *img) {
-    const unsigned char *ihdr, *idat, *plte, *trns, *first;
-    int trnsSize = 0;
-    int depth, ctype, bipp;
-    int datalen = 0;
-    ImageBuffer *img = NULL;
-    unsigned char *data = NULL, *out;
+typedef struct {
+    int w, y, ctype, bipp, bpp, len, trnsSize;
+    const unsigned char *plte, *trns;
+    uint32_t *lut;
+    unsigned char *cur, *prev;
+    unsigned char *dest, *narrow;
+    int pitch, native, depth, channels, wide;
+    jeff_png_row_cb cb;
+    void *userdata;
+    int hold, held;
+    unsigned char *raw;
+    Arena *spill;
+    // Adam7, `w` and `len` are for the current pass
+    int interlaced, pass, passY, passH, width, height, bytes;
+    unsigned char *line;
+    // Scaled decodes, column sums of the rows so far in a block
+    int shift;
+    void *sums;
+    // Region decodes, rows [y0, y1) and `cols` columns from x0 (0 for all)
+    int x0, cols, y0, y1;
+    jeff_png_pass_cb progress;
+    void *progressData;
+} Rows;
+
+// 16-bit rows to R16, RG16 or RGBA16 in host order, or the 8-bit formats.
+// An alpha channel is added for RGB and for a tRNS key.
+static void native16(const Rows *r, unsigned char *dest) {
+    const unsigned char *src = r->cur;
+    int x, c, ch = r->bipp / 16;
+    if (ch == r->channels) {
+        if (r->wide)
+            swap16(src, dest, r->w * ch * 2);
+        else
+            narrow16(src, dest, r->w * ch);
+        return;
+    }
+    for (x = 0; x < r->w; x++, src += ch * 2) {
+        int alpha = r->trns && !memcmp(src, r->trns, ch * 2) ? 0 : 0xffff;
+        for (c = 0; c < r->channels; c++) {
+            uint16_t v = c < ch ? src[c * 2] << 8 | src[c * 2 + 1] : alpha;
+            if (r->wide) {
+                memcpy(dest, &v, 2);
+                dest += 2;
+            } else
+                *dest++ = v >> 8;
+        }
+    }
+}
+
+// Grey as R8 or RG8 with tRNS as alpha, grey + alpha as RG8. Low bit depths
+// are scaled up to 8 bits.
+static void native_row(const Rows *r, unsigned char *dest) {
+    const unsigned char *src = r->cur;
+    int x, v, depth = r->depth, mask = (1 << depth) - 1;
+    if (depth == 16) {
+        native16(r, dest);
+        return;
+    }
+    if (r->ctype == 4 || (depth == 8 && !r->trns)) {
+        memcpy(dest, src, r->w * r->bipp / 8);
+        return;
+    }
+    for (x = 0; x < r->w; x++) {
+        v = (src[x * depth / 8] >> (8 - depth - x * depth % 8)) & mask;
+        *dest++ = v * (255 / mask);
+        if (r->trns)
+            *dest++ = (r->trns[0] << 8 | r->trns[1]) == v ? 0 : 255;
+    }
+}
+
+// 16-bit to RGBA8 keeps the high byte of each sample, but a tRNS key has to
+// match all 16 bits.
+static void convert16(const Rows *r, int *dest) {
+    const unsigned char *src = r->cur;
+    int x, ch = r->bipp / 16;
+    if (!r->trns) {
+        narrow16(src, r->narrow, r->w * ch);
+        convert(ch, r->w, r->narrow, dest, NULL);
+        return;
+    }
+    for (x = 0; x < r->w; x++, src += ch * 2) {
+        unsigned char alpha = memcmp(src, r->trns, ch * 2) ? 255 : 0;
+        *dest++ = ch == 1 ? RGBA1(src[0], alpha) : RGBA(src[0], src[2], src[4], alpha);
+    }
+}
+
+// Palette and low bit depth grey pixels come out of a table of 256 packed
+// colours, indices past the end of the palette are opaque black. Below 8 bits
+// it's followed by one that expands a whole byte of indices at once.
+static size_t lut_size(int bipp) {
+    return (256 + (bipp < 8 ? 256 * 8 / bipp : 0)) * sizeof(uint32_t);
+}
+
+static void build_lut(Rows *r) {
+    uint32_t *lut = r->lut, *expand = r->lut + 256;
+    int i, k, size, per = 8 / r->bipp, mask = (1 << r->bipp) - 1;
+    if (r->plte) {
+        size = get32(r->plte - 8) / 3;
+        for (i = 0; i < 256; i++)
+            lut[i] = i >= size ? RGB(0, 0, 0) : RGBA(r->plte[i * 3], r->plte[i * 3 + 1], r->plte[i * 3 + 2],
+                                                   i < r->trnsSize ? r->trns[i] : 255);
+    } else {
+        for (i = 0; i < 256; i++) {
+            unsigned char grey = (i & mask) * (255 / mask);
+            lut[i] = r->trns && (r->trns[0] << 8 | r->trns[1]) == i ? RGBA1(grey, 0) : RGB1(grey);
+        }
+    }
+    if (r->bipp < 8)
+        for (i = 0; i < 256; i++)
+            for (k = 0; k < per; k++)
+                expand[i * per + k] = lut[(i >> (8 - (k + 1) * r->bipp)) & mask];
+}
+
+// Adam7 passes: first column and row, then the steps between them.
+static const unsigned char adam7[7][4] = {
+    { 0, 0, 8, 8 }, { 4, 0, 8, 8 }, { 0, 4, 4, 8 }, { 2, 0, 4, 4 },
+    { 0, 2, 2, 4 }, { 1, 0, 2, 2 }, { 0, 1, 1, 2 }
+};
+
+// Moves on to the next Adam7 pass that has any pixels, 0 after the last.
+static int next_pass(Rows *r) {
+    while (++r->pass < 7) {
+        r->w = (r->width - adam7[r->pass][0] + adam7[r->pass][2] - 1) / adam7[r->pass][2];
+        r->passH = (r->height - adam7[r->pass][1] + adam7[r->pass][3] - 1) / adam7[r->pass][3];
+        if (r->w && r->passH) {
+            r->len = rowBytes(r->w, r->bipp);
+            r->passY = 0;
+            memset(r->prev, 0, r->len);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Puts a pass row's pixels in place. When decoding progressively each one
+// fills the block it stands for (a pass never covers pixels from the ones
+// before it), so the image is complete, if blocky, after every pass.
+static void deinterlace(Rows *r) {
+    const unsigned char *src = r->line;
+    int i, x, y, bw = 1, bh = 1, bytes = r->bytes;
+    int x0 = adam7[r->pass][0], dx = adam7[r->pass][2];
+    int y0 = adam7[r->pass][1] + r->passY * adam7[r->pass][3];
+    if (r->progress && r->pass < 6) {
+        // A pixel's block is as big as the next pass's steps.
+        bw = adam7[r->pass + 1][2];
+        bh = adam7[r->pass + 1][3];
+    }
+    for (y = y0; y < y0 + bh && y < r->height; y++) {
+        unsigned char *row = r->dest + (size_t)y * r->pitch;
+        for (i = 0, x = x0; i < r->w; i++, x += dx) {
+            int n = (x + bw < r->width ? bw : r->width - x) * bytes;
+            if (bytes == 4 && n == 4)
+                memcpy(row + x * 4, src + i * 4, 4);
+            else
+                for (int k = 0; k < n; k += bytes)
+                    memcpy(row + x * bytes + k, src + i * bytes, bytes);
+        }
+    }
+}
+
+static size_t sums_size(const Rows *r) {
+    return r->shift ? (size_t)r->width * r->channels * (r->wide ? sizeof(uint32_t) : sizeof(uint16_t)) : 0;
+}
+
+static size_t line_size(const Rows *r) {
+    return r->interlaced || r->shift || r->cols ? (size_t)r->w * r->bytes : 0;
+}
+
+// Scaled decodes add up a block's rows first, a whole row at a time, then
+// its columns once the last row is in. 8-bit sums fit in 16 bits.
+static void add_row(uint16_t *sum, const unsigned char *src, int len) {
+    int x = 0;
+#if defined(JEFF_PNG_SSE2)
+    __m128i zero = _mm_setzero_si128();
+    for (; x + 16 <= len; x += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(src + x));
+        __m128i *lo = (__m128i*)(sum + x), *hi = (__m128i*)(sum + x + 8);
+        _mm_storeu_si128(lo, _mm_add_epi16(_mm_loadu_si128(lo), _mm_unpacklo_epi8(v, zero)));
+        _mm_storeu_si128(hi, _mm_add_epi16(_mm_loadu_si128(hi), _mm_unpackhi_epi8(v, zero)));
+    }
+#elif defined(JEFF_PNG_NEON)
+    for (; x + 16 <= len; x += 16) {
+        uint8x16_t v = vld1q_u8(src + x);
+        vst1q_u16(sum + x, vaddw_u8(vld1q_u16(sum + x), vget_low_u8(v)));
+        vst1q_u16(sum + x + 8, vaddw_u8(vld1q_u16(sum + x + 8), vget_high_u8(v)));
+    }
+#endif
+    for (; x < len; x++)
+        sum[x] += src[x];
+}
+
+static void add_row16(uint32_t *sum, const uint16_t *src, int len) {
+    int x;
+    for (x = 0; x < len; x++)
+        sum[x] += src[x];
+}
+
+// Averages each block of `1 << shift` columns of a row of sums over `rows`
+// rows. It's inlined with a constant `ch` so the channels are unrolled, and
+// only blocks cut off by the edge of the image need a real divide.
+static inline void average(unsigned char *dest, const uint16_t *sum, int w, int shift, int rows, int ch) {
+    int x, c, end;
+    uint32_t n, total[4];
+    for (x = 0; x < w; dest += ch) {
+        end = x + (1 << shift) < w ? x + (1 << shift) : w;
+        n = (uint32_t)(end - x) * rows;
+        for (c = 0; c < ch; c++)
+            total[c] = n / 2;
+        for (; x < end; x++, sum += ch)
+            for (c = 0; c < ch; c++)
+                total[c] += sum[c];
+        for (c = 0; c < ch; c++)
+            dest[c] = (unsigned char)(n == 1u << 2 * shift ? total[c] >> 2 * shift : total[c] / n);
+    }
+}
+
+static inline void average16(uint16_t *dest, const uint32_t *sum, int w, int shift, int rows, int ch) {
+    int x, c, end;
+    uint32_t n, total[4];
+    for (x = 0; x < w; dest += ch) {
+        end = x + (1 << shift) < w ? x + (1 << shift) : w;
+        n = (uint32_t)(end - x) * rows;
+        for (c = 0; c < ch; c++)
+            total[c] = n / 2;
+        for (; x < end; x++, sum += ch)
+            for (c = 0; c < ch; c++)
+                total[c] += sum[c];
+        for (c = 0; c < ch; c++)
+            dest[c] = (uint16_t)(n == 1u << 2 * shift ? total[c] >> 2 * shift : total[c] / n);
+    }
+}
+
+// Adds a full size row to the sums, the output row is written once the last
+// row of its blocks is in. Blocks cut off by the edge of the image average
+// the pixels they have.
+static int shrink_row(Rows *r, const unsigned char *src, int y) {
+    int s = 1 << r->shift, ch = r->channels, ow = (r->width + s - 1) >> r->shift;
+    int rows = (y & (s - 1)) + 1;
+    unsigned char *dest;
+    if (rows == 1)
+        memset(r->sums, 0, sums_size(r));
+    if (r->wide)
+        add_row16((uint32_t*)r->sums, (const uint16_t*)src, r->width * ch);
+    else
+        add_row((uint16_t*)r->sums, src, r->width * ch);
+    if (rows != s && y != r->height - 1)
+        return 1;
     
-    PNG_CHECK(memcmp(png->p, "\211PNG\r\n\032\n", 8) == 0);  // PNG signature
-    png->p += 8;
-    first = png->p;
+    dest = r->cb ? r->dest : r->dest + (size_t)(y >> r->shift) * r->pitch;
+    if (r->wide)
+        switch (ch) {
+            case 1:
+                average16((uint16_t*)dest, (const uint32_t*)r->sums, r->width, r->shift, rows, 1);
+                break;
+            case 2:
+                average16((uint16_t*)dest, (const uint32_t*)r->sums, r->width, r->shift, rows, 2);
+                break;
+            default:
+                average16((uint16_t*)dest, (const uint32_t*)r->sums, r->width, r->shift, rows, 4);
+        }
+    else
+        switch (ch) {
+            case 1:
+                average(dest, (const uint16_t*)r->sums, r->width, r->shift, rows, 1);
+                break;
+            case 2:
+                average(dest, (const uint16_t*)r->sums, r->width, r->shift, rows, 2);
+                break;
+            default:
+                average(dest, (const uint16_t*)r->sums, r->width, r->shift, rows, 4);
+        }
+    return !r->cb || r->cb(r->userdata, y >> r->shift, (const int*)dest, ow);
+}
+
+// Converts the current row, or the region's columns of it. Those start from
+// the byte the first one is in, so below 8 bits a few pixels before it are
+// converted into `line` as well.
+static void convert_row(Rows *r, unsigned char *dest) {
+    unsigned char *cur = r->cur, *out = dest;
+    int w = r->w, lead = 0;
+    if (r->cols) {
+        lead = r->x0 * r->bipp % 8 / r->bipp;
+        r->cur += r->x0 * r->bipp / 8;
+        r->w = lead + r->cols;
+        if (lead)
+            out = r->line;
+    }
+    if (r->native)
+        native_row(r, out);
+    else if (r->lut)
+        depalette(r->w, r->cur, (int*)out, r->bipp, r->lut);
+    else if (r->depth == 16)
+        convert16(r, (int*)out);
+    else
+        convert(r->bipp / 8, r->w, r->cur, (int*)out, r->trns);
+    if (lead)
+        memcpy(dest, r->line + lead * r->bytes, (size_t)r->cols * r->bytes);
+    r->cur = cur;
+    r->w = w;
+}
+
+static int decode_row(void *user, const unsigned char *raw) {
+    // Unfilter into scratch and convert it while it's still in cache, the
+    // previous row is all the filters need.
+    Rows *r = (Rows*)user;
+    unsigned char *tmp = r->prev;
+    unsigned char *dest = r->interlaced || r->shift ? r->line : r->cb ? r->dest : r->dest + (size_t)(r->y - r->y0) * r->pitch;
+    
+    // A segment that starts partway down the image can't unfilter rows that
+    // need the row above until the segment before it is done, so hold on to
+    // them as they are.
+    if (r->hold) {
+        if (!r->raw && raw[0] < 2) {
+            r->hold = 0;
+        } else {
+            if (!r->raw && !(r->raw = arena(r->spill, (size_t)r->hold * (r->len + 1))))
+                return 0;
+            memcpy(r->raw + (size_t)r->held++ * (r->len + 1), raw, r->len + 1);
+            return r->len + 1;
+        }
+    }
+    memcpy(r->cur, raw + 1, r->len);
+    if (!unfilter_row(raw[0], r->cur, r->prev, r->len, r->bpp))
+        return 0;
+    // Rows above a region are only needed to unfilter the ones after.
+    if (r->y < r->y0) {
+        r->prev = r->cur;
+        r->cur = tmp;
+        r->y++;
+        return r->len + 1;
+    }
+    convert_row(r, dest);
+    r->prev = r->cur;
+    r->cur = tmp;
+    if (r->interlaced) {
+        deinterlace(r);
+        if (++r->passY == r->passH) {
+            // Empty passes are reported too, so the last call is always pass 7.
+            int done = r->pass;
+            next_pass(r);
+            for (; r->progress && done < r->pass; done++)
+                if (!r->progress(r->progressData, done + 1, r->dest, r->width, r->height, r->pitch))
+                    return 0;
+        }
+    } else if (r->shift) {
+        if (!shrink_row(r, dest, r->y))
+            return 0;
+    } else if (r->cb && !r->cb(r->userdata, r->y, (const int*)dest, r->w))
+        return 0;
+    r->y++;
+    return r->y == r->y1 && r->y1 < r->height ? -1 : r->len + 1;
+}
+
+// Sums for scaled decodes and a row of pixels for those and interlaced ones
+// first so they stay aligned, then current and previous rows and room to
+// narrow 16-bit rows.
+static size_t rows_size(const Rows *r) {
+    return sums_size(r) + line_size(r) + 2 * r->len + (r->depth == 16 ? r->len / 2 : 0);
+}
+
+static void rows_init(Rows *r, unsigned char *mem) {
+    r->sums = mem;
+    r->line = mem + sums_size(r);
+    r->cur = r->line + line_size(r);
+    r->prev = r->cur + r->len;
+    r->narrow = r->prev + r->len;
+    memset(r->prev, 0, r->len);
+}
+
+typedef struct {
+    PNG idat;
+    Arena *state;
+    int zlib, rows, ok;
+    Rows r;
+} Segment;
+
+static void decode_segment(Segment *seg) {
+    seg->ok = inflate(seg->state, &seg->idat, seg->zlib, seg->r.len + 1, seg->r.len + 1, seg->rows, decode_row, &seg->r, NULL);
+}
+
+#ifndef JEFF_PNG_NO_THREADS
+static void worker_lock(Worker *w) {
+#ifdef _WIN32
+    EnterCriticalSection(&w->lock);
+#else
+    pthread_mutex_lock(&w->lock);
+#endif
+}
+
+static void worker_unlock(Worker *w) {
+#ifdef _WIN32
+    LeaveCriticalSection(&w->lock);
+#else
+    pthread_mutex_unlock(&w->lock);
+#endif
+}
+
+#ifdef _WIN32
+static void worker_wait(Worker *w, CONDITION_VARIABLE *cond) {
+    SleepConditionVariableCS(cond, &w->lock, INFINITE);
+}
+
+static void worker_wake(CONDITION_VARIABLE *cond) {
+    WakeConditionVariable(cond);
+}
+#else
+static void worker_wait(Worker *w, pthread_cond_t *cond) {
+    pthread_cond_wait(cond, &w->lock);
+}
+
+static void worker_wake(pthread_cond_t *cond) {
+    pthread_cond_signal(cond);
+}
+#endif
+
+static void worker_run(Worker *w) {
+    worker_lock(w);
+    for (;;) {
+        while (!w->job && w->running)
+            worker_wait(w, &w->work);
+        if (!w->job)
+            break;
+        worker_unlock(w);
+        decode_segment((Segment*)w->job);
+        worker_lock(w);
+        w->job = NULL;
+        worker_wake(&w->done);
+    }
+    worker_unlock(w);
+}
+
+#ifdef _WIN32
+static DWORD WINAPI worker_thread(LPVOID arg) {
+    worker_run((Worker*)arg);
+    return 0;
+}
+#else
+static void* worker_thread(void *arg) {
+    worker_run((Worker*)arg);
+    return NULL;
+}
+#endif
+
+static void worker_destroy(Worker *w) {
+#ifdef _WIN32
+    DeleteCriticalSection(&w->lock);
+#else
+    pthread_mutex_destroy(&w->lock);
+    pthread_cond_destroy(&w->work);
+    pthread_cond_destroy(&w->done);
+#endif
+}
+
+static int worker_start(Worker *w) {
+    if (w->running)
+        return 1;
+    w->job = NULL;
+#ifdef _WIN32
+    InitializeCriticalSection(&w->lock);
+    InitializeConditionVariable(&w->work);
+    InitializeConditionVariable(&w->done);
+#else
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->work, NULL);
+    pthread_cond_init(&w->done, NULL);
+#endif
+    w->running = 1;
+#ifdef _WIN32
+    if ((w->thread = CreateThread(NULL, 0, worker_thread, w, 0, NULL)))
+        return 1;
+#else
+    if (pthread_create(&w->thread, NULL, worker_thread, w) == 0)
+        return 1;
+#endif
+    w->running = 0;
+    worker_destroy(w);
+    return 0;
+}
+
+static void worker_stop(Worker *w) {
+    if (!w->running)
+        return;
+    worker_lock(w);
+    w->running = 0;
+    worker_wake(&w->work);
+    worker_unlock(w);
+#ifdef _WIN32
+    WaitForSingleObject(w->thread, INFINITE);
+    CloseHandle(w->thread);
+#else
+    pthread_join(w->thread, NULL);
+#endif
+    worker_destroy(w);
+}
+
+// Hands `seg` to the worker, starting it if it isn't running yet. Returns 0
+// if it can't be started.
+static int worker_submit(Worker *w, Segment *seg) {
+    if (!worker_start(w))
+        return 0;
+    worker_lock(w);
+    w->job = seg;
+    worker_wake(&w->work);
+    worker_unlock(w);
+    return 1;
+}
+
+static void worker_finish(Worker *w) {
+    worker_lock(w);
+    while (w->job)
+        worker_wait(w, &w->done);
+    worker_unlock(w);
+}
+#endif
+
+// Images written by macOS carry an iDOT chunk that splits the IDAT stream
+// at a full flush, so each part inflates on its own. Returns 0 if there's no
+// usable split, the caller then decodes the usual way, and -1 if a segment
+// failed to decode.
+static int decode_segments(jeff_png_decoder *dec, PNG *png, const unsigned char *first, Rows *r, unsigned h) {
+    const unsigned char *idot, *split;
+    Segment seg[MAX_SEGMENTS];
+    int i, j, n = 0;
+#ifndef JEFF_PNG_NO_THREADS
+    int queued[MAX_SEGMENTS] = { 0 };
+#endif
     
-    // Read IHDR
-    ihdr = find(png, "IHDR", 13);
-    PNG_CHECK(ihdr);
-    depth = ihdr[8];
-    ctype = ihdr[9];
-    switch (ctype) {
+    // iDOT: divisor, 0, divided height, 0x28, first height, second height
+    // and the offset of the second half's IDAT from the start of the iDOT.
+    png->p = first;
+    idot = find(png, "iDOT", 28);
+    if (r->cb || r->interlaced || r->cols || png->frame || !idot || get32(idot) != 2 || (size_t)r->len * h < WINDOW)
+        return 0;
+    seg[0].rows = get32(idot + 16);
+    seg[1].rows = get32(idot + 20);
+    if (seg[0].rows <= 0 || seg[1].rows <= 0 || (unsigned)seg[0].rows + seg[1].rows != h
+        || get32(idot + 24) > (size_t)(png->end - (idot - 8)) - 12)
+        return 0;
+    // Scaled rows are summed a block at a time, which can't be split.
+    if (seg[0].rows & ((1 << r->shift) - 1))
+        return 0;
+    split = idot - 8 + get32(idot + 24);
+    if (split < idot || memcmp(split + 4, "IDAT", 4) != 0)
+        return 0;
+    
+    // The first segment uses the caller's rows, the others get their own.
+    for (n = 0; n < MAX_SEGMENTS; n++) {
+        unsigned char *mem = n ? arena(&dec->rows[n], rows_size(r)) : (unsigned char*)r->sums;
+        if (!mem)
+            return 0;
+        seg[n].r = *r;
+        rows_init(&seg[n].r, mem);
+        seg[n].r.spill = &dec->held[n];
+        seg[n].state = &dec->state[n];
+        seg[n].idat = *png;
+        seg[n].idat.p = n ? split : first;
+        seg[n].idat.end = n ? png->end : split;
+        seg[n].zlib = !n;
+        seg[n].ok = 0;
+        seg[n].r.y = n ? seg[n - 1].r.y + seg[n - 1].rows : 0;
+        seg[n].r.hold = n ? seg[n].rows : 0;
+    }
+    
+    // The first segment runs here while the rest go to the decoder's workers,
+    // if one can't be started its segment is just decoded in turn.
+    for (i = 1; i < n; i++) {
+#ifndef JEFF_PNG_NO_THREADS
+        if ((queued[i] = worker_submit(&dec->workers[i - 1], &seg[i])))
+            continue;
+#endif
+        decode_segment(&seg[i]);
+    }
+    decode_segment(&seg[0]);
+#ifndef JEFF_PNG_NO_THREADS
+    for (i = 1; i < n; i++)
+        if (queued[i])
+            worker_finish(&dec->workers[i - 1]);
+#endif
+    
+    // Finish the rows that were held back, now the row above is known.
+    for (i = 0; i < n && seg[i].ok; i++) {
+        Rows *sr = &seg[i].r;
+        if (!sr->raw)
+            continue;
+        memcpy(sr->prev, seg[i - 1].r.prev, r->len);
+        sr->hold = 0;
+        for (j = 0; j < sr->held && seg[i].ok; j++)
+            seg[i].ok = decode_row(sr, sr->raw + (size_t)j * (r->len + 1));
+    }
+    return i == n ? 1 : -1;
+}
+
+static int read_header(const unsigned char *data, size_t size, jeff_png_info *info) {
+    PNG png = {
+        .p = data + 8,
+        .end = data + size
+    };
+    const unsigned char *ihdr, *plte;
+    unsigned channels, len, w, h;
+    int i;
+    memset(info, 0, sizeof(jeff_png_info));
+    if (size < 8 || memcmp(data, "\211PNG\r\n\032\n", 8) || !(ihdr = find(&png, "IHDR", 13)))
+        return 0;
+    // Checked before they go in the int fields, a size with the top bit set
+    // would otherwise come out negative.
+    w = get32(ihdr + 0);
+    h = get32(ihdr + 4);
+    if (!(0 < w && w < 1u << 24) || !(0 < h && h < 1u << 24))
+        return 0;
+    info->width = w;
+    info->height = h;
+    info->depth = ihdr[8];
+    info->color_type = ihdr[9];
+    info->interlaced = ihdr[12];
+    switch (info->color_type) {
         case 0:
-            bipp = depth;
-            break;  // greyscale
+            channels = 1;
+            break;
         case 2:
-            bipp = 3 * depth;
-            break;  // RGB
+            channels = 3;
+            break;
         case 3:
-            bipp = depth;
-            break;  // paletted
+            channels = 1;
+            break;
         case 4:
-            bipp = 2 * depth;
-            break;  // grey+alpha
+            channels = 2;
+            break;
         case 6:
-            bipp = 4 * depth;
-            break;  // RGBA
+            channels = 4;
+            break;
         default:
-            PNG_FAIL();
+            return 0;
     }
+    if (ihdr[10] != 0 || ihdr[11] != 0 || ihdr[12] > 1
+        || info->depth > 16 || info->depth & (info->depth - 1) || !info->depth
+        || (info->color_type == 3 ? info->depth > 8 : info->color_type != 0 && info->depth < 8))
+        return 0;
     
-    // Allocate bitmap (+1 width to save room for stupid PNG filter bytes)
-    img->w = get32(ihdr + 0) + 1;
-    img->h = get32(ihdr + 4);
-    img->buf = malloc(img->w * img->h * sizeof(int));
-    PNG_CHECK(img->buf);
-    img->w--;
+    // Palette and transparency come before the image data, so they're only
+    // missed if the data stops short.
+    plte = find(&png, "PLTE", 0);
+    if (plte)
+        info->palette_size = get32(plte - 8) / 3;
+    png.p = data + 8;
+    info->transparency = find(&png, "tRNS", 0) != NULL;
     
-    // We support 8-bit color components and 1, 2, 4 and 8 bit palette formats.
-    // No interlacing, or wacky filter types.
-    PNG_CHECK((depth != 16) && ihdr[10] == 0 && ihdr[11] == 0 && ihdr[12] == 0);
+    if (info->color_type == 0 && !info->transparency)
+        info->native_format = info->depth == 16 ? SG_PIXELFORMAT_R16 : SG_PIXELFORMAT_R8;
+    else if (info->color_type == 0 || info->color_type == 4)
+        info->native_format = info->depth == 16 ? SG_PIXELFORMAT_RG16 : SG_PIXELFORMAT_RG8;
+    else
+        info->native_format = info->depth == 16 ? SG_PIXELFORMAT_RGBA16 : SG_PIXELFORMAT_RGBA8;
     
-    // Join IDAT chunks.
-    for (idat = find(png, "IDAT", 0); idat; idat = find(png, "IDAT", 0)) {
-        unsigned len = get32(idat - 8);
-        data = realloc(data, datalen + len);
-        if (!data)
-            break;
-        
-        memcpy(data + datalen, idat, len);
-        datalen += len;
+    len = rowBytes(info->width, channels * info->depth);
+    info->image_bytes = (size_t)info->width * info->height * sizeof(int);
+    info->native_bytes = (size_t)info->width * info->height * format_bytes(info->native_format);
+    if (info->interlaced)
+        for (i = 0; i < 7; i++) {
+            int pw = (info->width - adam7[i][0] + adam7[i][2] - 1) / adam7[i][2];
+            int ph = (info->height - adam7[i][1] + adam7[i][3] - 1) / adam7[i][3];
+            if (pw && ph)
+                info->inflate_bytes += (size_t)(rowBytes(pw, channels * info->depth) + 1) * ph;
+        }
+    else
+        info->inflate_bytes = (size_t)(len + 1) * info->height;
+    info->scratch_bytes = sizeof(State) + 2 * WINDOW + INFLATE_SLACK + 3 * (len + 1);
+    if (info->interlaced)
+        info->scratch_bytes += (size_t)info->width * format_bytes(info->native_format);
+    return 1;
+}
+
+int jeff_png_probe(const unsigned char *data, int data_size, jeff_png_info *info) {
+    assert(data && info);
+    return data_size > 0 && read_header(data, data_size, info);
+}
+
+// With JEFF_PNG_VERIFY every chunk's CRC is checked, up to IEND, before
+// anything is decoded. Chunk types that aren't letters are shown as '?'.
+static int verify_chunks(jeff_png_decoder *dec, const unsigned char *start, const unsigned char *p, const unsigned char *end) {
+    char name[5] = { 0 };
+    uint32_t len;
+    int i;
+    crc_ready();
+    for (;; p += len + 12) {
+        if (end - p < 12 || (len = get32(p)) > (size_t)(end - p) - 12) {
+            snprintf(dec->error, sizeof(dec->error), p == end ? "no IEND chunk" : "chunk at offset %ld is cut off", (long)(p - start));
+            return 0;
+        }
+        for (i = 0; i < 4; i++)
+            name[i] = (p[4 + i] | 32) >= 'a' && (p[4 + i] | 32) <= 'z' ? p[4 + i] : '?';
+        if (crc_update(0, p + 4, len + 4) != get32(p + len + 8)) {
+            snprintf(dec->error, sizeof(dec->error), "CRC mismatch in %s chunk at offset %ld", name, (long)(p - start));
+            return 0;
+        }
+        if (!memcmp(name, "IEND", 4))
+            return 1;
     }
+}
+
+// Decodes into img->buf, or a row at a time into `cb` when it's given. If
+// img->buf is NULL the decoder's image memory is used.
+static int load_png(jeff_png_decoder *dec, PNG *png, ImageBuffer *img, jeff_png_row_cb cb, void *userdata) {
+    const unsigned char *first;
+    jeff_png_info info;
+    jeff_png_row_cb rowcb = NULL;
+    int depth, i, bytes, len, total, w, h, segmented, verify = (dec->flags & JEFF_PNG_VERIFY) != 0;
+    size_t scratch;
+    unsigned char *rows, *full = NULL;
+    Rows r = { 0 };
     
-    // Find palette.
+    dec->error[0] = '\0';
+    PNG_CHECK(read_header(png->p, png->end - png->p, &info));
+    png->p += 8;
+    first = png->p;
+    PNG_CHECK(!verify || png->frame || verify_chunks(dec, png->p - 8, first, png->end));
+    depth = info.depth;
+    r.ctype = info.color_type;
+    r.bipp = depth * (r.ctype == 2 ? 3 : r.ctype == 4 ? 2 : r.ctype == 6 ? 4 : 1);
+    img->w = (unsigned)info.width;
+    img->h = (unsigned)info.height;
+    if (png->frame) {
+        unsigned fw = get32(png->frame + 4), fh = get32(png->frame + 8);
+        PNG_CHECK(0 < fw && fw <= img->w && 0 < fh && fh <= img->h);
+        img->w = fw;
+        img->h = fh;
+    }
+    img->format = !cb && dec->flags & JEFF_PNG_NATIVE ? info.native_format : SG_PIXELFORMAT_RGBA8;
+    if (dec->flags & JEFF_PNG_8BIT)
+        img->format = img->format == SG_PIXELFORMAT_R16 ? SG_PIXELFORMAT_R8
+                    : img->format == SG_PIXELFORMAT_RG16 ? SG_PIXELFORMAT_RG8
+                    : img->format == SG_PIXELFORMAT_RGBA16 ? SG_PIXELFORMAT_RGBA8 : img->format;
+    bytes = format_bytes(img->format);
+    r.native = img->format != SG_PIXELFORMAT_RGBA8;
+    r.depth = depth;
+    r.wide = img->format == SG_PIXELFORMAT_R16 || img->format == SG_PIXELFORMAT_RG16 || img->format == SG_PIXELFORMAT_RGBA16;
+    r.channels = bytes / (r.wide ? 2 : 1);
+    
+    // Interlaced rows aren't finished until the last pass, so they're decoded
+    // whole and handed out afterwards.
+    r.interlaced = info.interlaced;
+    r.width = img->w;
+    r.height = img->h;
+    r.bytes = bytes;
+    if (r.interlaced) {
+        rowcb = cb;
+        cb = NULL;
+        r.progress = dec->progress;
+        r.progressData = dec->progressData;
+    }
+    
+    // From here on img is the size that comes out. Regions are full size,
+    // interlaced ones are cut out of the whole image.
+    r.shift = dec->scale == 8 ? 3 : dec->scale == 4 ? 2 : dec->scale == 2 ? 1 : 0;
+    w = img->w;
+    h = img->h;
+    r.y1 = h;
+    if (img->rw) {
+        PNG_CHECK(img->rh && img->x < (unsigned)w && img->y < (unsigned)h
+                  && img->rw <= w - img->x && img->rh <= h - img->y);
+        r.shift = 0;
+        img->w = img->rw;
+        img->h = img->rh;
+        if (!r.interlaced) {
+            r.x0 = img->x;
+            r.cols = img->rw;
+            r.y0 = img->y;
+            r.y1 = img->y + img->rh;
+        }
+    } else {
+        img->w = (w + (1 << r.shift) - 1) >> r.shift;
+        img->h = (h + (1 << r.shift) - 1) >> r.shift;
+    }
+    PNG_CHECK(!img->buf || (img->pitch > 0 && (unsigned)img->pitch >= img->w * bytes && img->pitch % (r.native ? 1 : 4) == 0));
+    
+    // Find palette, other colour types may have a suggested one to ignore.
     png->p = first;
-    plte = find(png, "PLTE", 0);
+    r.plte = r.ctype == 3 ? find(png, "PLTE", 0) : NULL;
+    PNG_CHECK(r.ctype != 3 || r.plte);
     
     // Find transparency info.
     png->p = first;
-    trns = find(png, "tRNS", 0);
-    if (trns) {
-        trnsSize = get32(trns - 8);
+    r.trns = find(png, "tRNS", 0);
+    if (r.trns) {
+        r.trnsSize = get32(r.trns - 8);
+        if (r.ctype == 4 || r.ctype == 6 || r.trnsSize < (r.ctype == 0 ? 2 : r.ctype == 2 ? 6 : 0))
+            r.trns = NULL;
     }
     
-    PNG_CHECK(data && datalen >= 6);
-    PNG_CHECK((data[0] & 0x0f) == 0x08  // compression method (RFC 1950)
-          && (data[0] & 0xf0) <= 0x70   // window size
-          && (data[1] & 0x20) == 0);    // preset dictionary present
+    // Low bit depth grey is decoded like a palette of greys.
+    if (r.ctype == 3 || (r.ctype == 0 && depth < 8 && !r.native)) {
+        r.lut = arena(&dec->palette, lut_size(r.bipp));
+        PNG_CHECK(r.lut);
+        build_lut(&r);
+    }
     
-    out = (unsigned char*)img->buf + outsize(img, 32) - outsize(img, bipp);
-    PNG_CHECK(inflate(out, outsize(img, bipp), data + 2, datalen - 6));
-    PNG_CHECK(unfilter(img->w, img->h, bipp, out));
+    // Two rows of filter context, plus one row of pixels when streaming.
+    r.w = w;
+    r.len = rowBytes(w, r.bipp);
+    r.bpp = rowBytes(1, r.bipp);
+    r.cb = cb;
+    r.userdata = userdata;
+    scratch = cb ? img->w * sizeof(int) : 0;
+    rows = arena(&dec->rows[0], scratch + rows_size(&r));
+    PNG_CHECK(rows);
+    rows_init(&r, rows + scratch);
+    if (cb)
+        r.dest = rows;
+    else {
+        if (!img->buf) {
+            img->buf = arena(&dec->image, (size_t)img->w * img->h * bytes);
+            img->pitch = img->w * bytes;
+            PNG_CHECK(img->buf);
+        }
+        r.dest = (unsigned char*)img->buf;
+        r.pitch = img->pitch;
+    }
+    if (r.interlaced && (r.shift || img->rw)) {
+        PNG_CHECK(full = arena(&dec->full, (size_t)w * h * bytes));
+        r.dest = full;
+        r.pitch = w * bytes;
+    }
     
-    if (ctype == 3) {
-        PNG_CHECK(plte);
-        depalette(img->w, img->h, out, img->buf, bipp, plte, trns, trnsSize);
-    } else {
-        PNG_CHECK(bipp % 8 == 0);
-        convert(bipp / 8, img->w, img->h, out, img->buf, trns);
+    // Rows are unfiltered and converted as they come out of the inflater,
+    // which reads the IDAT (or fdAT) chunks in place.
+    segmented = verify ? 0 : decode_segments(dec, png, first, &r, h);
+    PNG_CHECK(segmented >= 0);
+    if (!segmented) {
+        rows_init(&r, rows + scratch);
+        len = r.len + 1;
+        total = h;
+        if (r.interlaced) {
+            for (total = 0, r.pass = -1; next_pass(&r);)
+                total += r.passH;
+            r.pass = -1;
+            next_pass(&r);
+        }
+        png->p = png->frame ? png->frame + get32(png->frame - 8) + 4 : first;
+        if (!inflate(&dec->state[0], png, 1, r.len + 1, len, total, decode_row, &r, &verify)) {
+            if (verify < 0)
+                snprintf(dec->error, sizeof(dec->error), "Adler-32 mismatch in the IDAT data");
+            PNG_FAIL();
+        }
     }
+    dec->format = img->format;
     
-    free(data);
-    return img;
+    // Interlaced images are scaled down or cut once they're whole.
+    if (full && img->rw) {
+        for (i = 0; i < (int)img->rh; i++)
+            memcpy((unsigned char*)img->buf + (size_t)i * img->pitch,
+                   full + ((size_t)(img->y + i) * w + img->x) * bytes, (size_t)img->rw * bytes);
+    } else if (full) {
+        r.dest = (unsigned char*)img->buf;
+        r.pitch = img->pitch;
+        for (i = 0; i < h; i++)
+            shrink_row(&r, full + (size_t)i * w * bytes, i);
+    }
+    for (i = 0; rowcb && i < (int)img->h; i++)
+        PNG_CHECK(rowcb(userdata, i, img->buf + (size_t)i * img->w, img->w));
+    return 1;
     
 err:
-    if (data)
-        free(data);
-    if (img->buf)
-        free(img->buf);
-    return NULL;
+    img->buf = NULL;
+    return 0;
 }
 
-static int* load_texture_data(unsigned char *data, int data_size, int *w, int *h) {
-    assert(data && data_size);
+jeff_png_decoder* jeff_png_decoder_new(void) {
+    return calloc(1, sizeof(jeff_png_decoder));
+}
+
+static void release_decoder(jeff_png_decoder *dec) {
+#ifndef JEFF_PNG_NO_THREADS
+    for (int i = 0; i < MAX_SEGMENTS - 1; i++)
+        worker_stop(&dec->workers[i]);
+#endif
+    for (int i = 0; i < MAX_SEGMENTS; i++) {
+        free(dec->state[i].ptr);
+        free(dec->rows[i].ptr);
+        free(dec->held[i].ptr);
+    }
+    free(dec->image.ptr);
+    free(dec->palette.ptr);
+    free(dec->full.ptr);
+}
+
+void jeff_png_decoder_free(jeff_png_decoder *dec) {
+    if (dec) {
+        release_decoder(dec);
+        free(dec);
+    }
+}
+
+void jeff_png_decoder_flags(jeff_png_decoder *dec, int flags) {
+    dec->flags = flags;
+}
+
+const char* jeff_png_decoder_error(jeff_png_decoder *dec) {
+    return dec->error[0] ? dec->error : NULL;
+}
+
+sg_pixel_format jeff_png_decoder_format(jeff_png_decoder *dec) {
+    return dec->format;
+}
+
+void jeff_png_decoder_progressive(jeff_png_decoder *dec, jeff_png_pass_cb cb, void *userdata) {
+    dec->progress = cb;
+    dec->progressData = userdata;
+}
+
+void jeff_png_decoder_scale(jeff_png_decoder *dec, int scale) {
+    assert(scale == 1 || scale == 2 || scale == 4 || scale == 8);
+    dec->scale = scale;
+}
+
+const void* jeff_png_decoder_load(jeff_png_decoder *dec, unsigned char *data, int data_size, int *width, int *height) {
+    assert(dec && data && data_size);
+    PNG png = {
+        .p = (unsigned char*)data,
+        .end = (unsigned char*)data + data_size
+    };
+    ImageBuffer tmp = { 0 };
+    if (!load_png(dec, &png, &tmp, NULL, NULL))
+        return NULL;
+    if (width)
+        *width = tmp.w;
+    if (height)
+        *height = tmp.h;
+    return tmp.buf;
+}
+
+int jeff_png_decoder_rows(jeff_png_decoder *dec, unsigned char *data, int data_size, jeff_png_row_cb cb, void *userdata, int *width, int *height) {
+    assert(dec && data && data_size && cb);
+    PNG png = {
+        .p = (unsigned char*)data,
+        .end = (unsigned char*)data + data_size
+    };
+    ImageBuffer tmp = { 0 };
+    if (!load_png(dec, &png, &tmp, cb, userdata))
+        return 0;
+    if (width)
+        *width = tmp.w;
+    if (height)
+        *height = tmp.h;
+    return 1;
+}
+
+int jeff_png_decoder_load_into(jeff_png_decoder *dec, unsigned char *data, int data_size, void *pixels, int pitch) {
+    assert(dec && data && data_size && pixels);
     PNG png = {
         .p = (unsigned char*)data,
         .end = (unsigned char*)data + data_size
     };
-    ImageBuffer tmp;
-    load_png(&png, &tmp);
-    if (!tmp->w || !tmp->h || !tmp->buf) {
-        if (tmp->buf)
-            free(tmp->buf);
+    ImageBuffer tmp = {
+        .buf = (int*)pixels,
+        .pitch = pitch
+    };
+    return load_png(dec, &png, &tmp, NULL, NULL);
+}
+
+int jeff_png_decoder_region(jeff_png_decoder *dec, unsigned char *data, int data_size, int x, int y, int width, int height, void *pixels, int pitch) {
+    assert(dec && data && data_size && pixels);
+    PNG png = {
+        .p = (unsigned char*)data,
+        .end = (unsigned char*)data + data_size
+    };
+    ImageBuffer tmp = {
+        .buf = (int*)pixels,
+        .pitch = pitch,
+        .x = x,
+        .y = y,
+        .rw = width,
+        .rh = height
+    };
+    return x >= 0 && y >= 0 && width > 0 && height > 0 && load_png(dec, &png, &tmp, NULL, NULL);
+}
+
+size_t jeff_img_size(unsigned char *data, int data_size, int *width, int *height) {
+    assert(data && data_size);
+    jeff_png_info info;
+    if (!read_header(data, data_size, &info))
+        return 0;
+    if (width)
+        *width = info.width;
+    if (height)
+        *height = info.height;
+    return info.image_bytes;
+}
+
+int jeff_img_load_into(unsigned char *data, int data_size, void *pixels, int pitch) {
+    jeff_png_decoder dec = { 0 };
+    int result = jeff_png_decoder_load_into(&dec, data, data_size, pixels, pitch);
+    release_decoder(&dec);
+    return result;
+}
+
+int jeff_png_load_region(unsigned char *data, int data_size, int x, int y, int width, int height, void *pixels, int pitch) {
+    jeff_png_decoder dec = { 0 };
+    int result = jeff_png_decoder_region(&dec, data, data_size, x, y, width, height, pixels, pitch);
+    release_decoder(&dec);
+    return result;
+}
+
+sg_image jeff_png_decoder_texture(jeff_png_decoder *dec, unsigned char *data, int data_size, int *width, int *height) {
+    int w, h;
+    const void *pixels = jeff_png_decoder_load(dec, data, data_size, &w, &h);
+    if (!pixels)
+        return (sg_image){.id=SG_INVALID_ID};
+    sg_image texture = empty_texture(w, h, dec->format);
+    sg_image_data desc = {
+        .subimage[0][0] = (sg_range) {
+            .ptr = pixels,
+            .size = (size_t)w * h * format_bytes(dec->format)
+        }
+    };
+    sg_update_image(texture, &desc);
+    if (width)
+        *width = w;
+    if (height)
+        *height = h;
+    return texture;
+}
+
+struct jeff_apng {
+    jeff_png_decoder dec;
+    PNG png;
+    const unsigned char *idat;  // the first IDAT, frames before it use the image
+    const unsigned char *next;  // where to look for the next fcTL
+    int width, height, animated, frames, plays, frame;
+    int dispose, x, y, w, h;    // how to clear up after the last frame drawn
+    uint32_t *canvas, *saved;
+};
+
+jeff_apng* jeff_apng_open(unsigned char *data, int data_size, int *width, int *height, int *frames) {
+    assert(data && data_size);
+    jeff_png_info info;
+    jeff_apng *apng;
+    const unsigned char *actl;
+    if (!read_header(data, data_size, &info)
+        || (size_t)info.width * info.height > SIZE_MAX / 4 / 2)
+        return NULL;
+    if (!(apng = calloc(1, sizeof(jeff_apng))))
+        return NULL;
+    apng->png.p = data + 8;
+    apng->png.end = data + data_size;
+    apng->width = info.width;
+    apng->height = info.height;
+    apng->frames = apng->plays = 1;
+    
+    // acTL: frames and plays, it has to come before the image data.
+    actl = find(&apng->png, "acTL", 8);
+    apng->png.p = data + 8;
+    apng->idat = find(&apng->png, "IDAT", 0);
+    if (actl && apng->idat && actl < apng->idat && get32(actl) > 0 && get32(actl) <= INT_MAX) {
+        apng->animated = 1;
+        apng->frames = get32(actl);
+        apng->plays = get32(actl + 4);
+    }
+    apng->png.p = data;
+    apng->frame = apng->frames;
+    if (!apng->idat || !(apng->canvas = malloc((size_t)apng->width * apng->height * 4))) {
+        jeff_apng_close(apng);
+        return NULL;
+    }
+    if (width)
+        *width = apng->width;
+    if (height)
+        *height = apng->height;
+    if (frames)
+        *frames = apng->frames;
+    return apng;
+}
+
+void jeff_apng_close(jeff_apng *apng) {
+    if (apng) {
+        release_decoder(&apng->dec);
+        free(apng->canvas);
+        free(apng->saved);
+        free(apng);
+    }
+}
+
+int jeff_apng_plays(jeff_apng *apng) {
+    return apng->plays;
+}
+
+static void copy_rect(uint32_t *dest, const uint32_t *src, int pitch, int x, int y, int w, int h) {
+    for (int i = y; i < y + h; i++)
+        memcpy(dest + (size_t)i * pitch + x, src + (size_t)i * pitch + x, w * 4);
+}
+
+// APNG_BLEND_OP_OVER, neither colour is premultiplied.
+static uint32_t blend_over(uint32_t src, uint32_t dest) {
+    unsigned sa = src >> 24, da = dest >> 24, fa, ba, oa, c;
+    uint32_t out;
+    if (sa == 255 || !da)
+        return src;
+    if (!sa)
+        return dest;
+    fa = sa * 255;
+    ba = da * (255 - sa);
+    oa = fa + ba;
+    out = (uint32_t)(oa + 127) / 255 << 24;
+    for (c = 0; c < 24; c += 8)
+        out |= ((src >> c & 255) * fa + (dest >> c & 255) * ba + oa / 2) / oa << c;
+    return out;
+}
+
+const void* jeff_apng_next(jeff_apng *apng, float *delay) {
+    assert(apng);
+    PNG png = apng->png;
+    ImageBuffer frame = { 0 };
+    const unsigned char *fctl = NULL;
+    int i, j, blend = 0, num = 0, den = 100;
+    uint32_t *dest;
+    const uint32_t *src;
+    
+    // Clear up after the last frame, or start again once they've all been.
+    if (apng->frame < apng->frames) {
+        if (apng->dispose == 1)
+            for (i = apng->y; i < apng->y + apng->h; i++)
+                memset(apng->canvas + (size_t)i * apng->width + apng->x, 0, apng->w * 4);
+        else if (apng->dispose == 2)
+            copy_rect(apng->canvas, apng->saved, apng->width, apng->x, apng->y, apng->w, apng->h);
+        png.p = apng->next;
+        fctl = find(&png, "fcTL", 26);
+    }
+    if (!fctl) {
+        memset(apng->canvas, 0, (size_t)apng->width * apng->height * 4);
+        apng->frame = 0;
+        png.p = apng->png.p + 8;
+        fctl = apng->animated ? find(&png, "fcTL", 26) : NULL;
+        PNG_CHECK(fctl || !apng->animated);
+    }
+    apng->next = png.p;
+    
+    // fcTL: sequence number, size, offset, delay fraction, dispose and blend.
+    // A plain png is one frame of the whole image.
+    apng->x = apng->y = apng->dispose = 0;
+    apng->w = apng->width;
+    apng->h = apng->height;
+    if (fctl) {
+        // The frame has to fit on the canvas, checked as unsigned before it
+        // goes in the int fields.
+        unsigned fw = get32(fctl + 4), fh = get32(fctl + 8), fx = get32(fctl + 12), fy = get32(fctl + 16);
+        PNG_CHECK(fw > 0 && fh > 0 && fx <= (unsigned)apng->width && fy <= (unsigned)apng->height
+                  && fw <= (unsigned)apng->width - fx && fh <= (unsigned)apng->height - fy);
+        apng->w = (int)fw;
+        apng->h = (int)fh;
+        apng->x = (int)fx;
+        apng->y = (int)fy;
+        num = fctl[20] << 8 | fctl[21];
+        den = fctl[22] << 8 | fctl[23];
+        apng->dispose = fctl[24];
+        blend = fctl[25];
+        PNG_CHECK(apng->dispose <= 2 && blend <= 1);
+        if (!den)
+            den = 100;
+        // There's nothing to go back to before the first frame.
+        if (apng->dispose == 2 && apng->frame == 0)
+            apng->dispose = 1;
+    }
+    if (apng->dispose == 2) {
+        PNG_CHECK(apng->saved || (apng->saved = malloc((size_t)apng->width * apng->height * 4)));
+        copy_rect(apng->saved, apng->canvas, apng->width, apng->x, apng->y, apng->w, apng->h);
+    }
+    
+    // Frames after the image are in fdAT chunks, which start with a sequence
+    // number.
+    png.p = apng->png.p;
+    png.frame = fctl && fctl > apng->idat ? fctl : NULL;
+    png.chunk = png.frame ? "fdAT" : NULL;
+    png.skip = png.frame ? 4 : 0;
+    PNG_CHECK(load_png(&apng->dec, &png, &frame, NULL, NULL));
+    PNG_CHECK(frame.w == (unsigned)apng->w && frame.h == (unsigned)apng->h);
+    for (i = 0; i < apng->h; i++) {
+        dest = apng->canvas + (size_t)(apng->y + i) * apng->width + apng->x;
+        src = (const uint32_t*)frame.buf + (size_t)i * apng->w;
+        if (blend)
+            for (j = 0; j < apng->w; j++)
+                dest[j] = blend_over(src[j], dest[j]);
+        else
+            memcpy(dest, src, apng->w * 4);
+    }
+    apng->frame++;
+    if (delay)
+        *delay = (float)num / den;
+    return apng->canvas;
+    
+err:
+    apng->frame = apng->frames;
+    return NULL;
+}
+
+int jeff_apng_update(jeff_apng *apng, sg_image texture, float *delay) {
+    const void *pixels = jeff_apng_next(apng, delay);
+    if (!pixels)
+        return 0;
+    sg_image_data desc = {
+        .subimage[0][0] = (sg_range) {
+            .ptr = pixels,
+            .size = (size_t)apng->width * apng->height * 4
+        }
+    };
+    sg_update_image(texture, &desc);
+    return 1;
+}
+
+sg_image jeff_apng_texture_array(jeff_apng *apng, float *delays) {
+    assert(apng);
+    size_t size = (size_t)apng->width * apng->height * 4;
+    unsigned char *layers = (size_t)apng->frames <= SIZE_MAX / size ? malloc(size * (size_t)apng->frames) : NULL;
+    const void *pixels;
+    sg_image texture;
+    int i;
+    if (!layers)
+        return (sg_image){.id=SG_INVALID_ID};
+    apng->frame = apng->frames;
+    for (i = 0; i < apng->frames; i++) {
+        if (!(pixels = jeff_apng_next(apng, delays ? delays + i : NULL))) {
+            free(layers);
+            return (sg_image){.id=SG_INVALID_ID};
+        }
+        memcpy(layers + size * i, pixels, size);
+    }
+    sg_image_desc desc = {
+        .type = SG_IMAGETYPE_ARRAY,
+        .width = apng->width,
+        .height = apng->height,
+        .num_slices = apng->frames,
+        .pixel_format = SG_PIXELFORMAT_RGBA8,
+        .data.subimage[0][0] = (sg_range) {
+            .ptr = layers,
+            .size = size * apng->frames
+        }
+    };
+    texture = sg_make_image(&desc);
+    free(layers);
+    return texture;
+}
+
+// The encoder only writes fixed Huffman blocks (or stored ones), it's meant
+// for screenshots and generated images where speed matters more than size.
+#define ENCODE_WINDOW 32768
+#define ENCODE_HASH_BITS 15
+#define MATCH_MAX 258
+
+typedef struct {
+    uint32_t lit[288];  // fixed Huffman codes, bit reversed to be written
+    unsigned char litLen[288];
+    unsigned char dist[30];
+    unsigned char lenSym[MATCH_MAX + 1];
+    unsigned char distSym[512];  // see dist_sym
+} Encoder;
+
+// Kept apart from the Encoder in a local, so the compiler can tell the bytes
+// written out don't touch it and keep it in registers.
+typedef struct {
+    unsigned char *out;
+    uint64_t bits;
+    int count;
+} Bits;
+
+static void encoder_init(Encoder *e) {
+    int i, j;
+    for (i = 0; i < 288; i++) {
+        int code, len;
+        if (i < 144)
+            code = 0x30 + i, len = 8;
+        else if (i < 256)
+            code = 0x190 + i - 144, len = 9;
+        else if (i < 280)
+            code = i - 256, len = 7;
+        else
+            code = 0xc0 + i - 280, len = 8;
+        e->lit[i] = rev16(code) >> (16 - len);
+        e->litLen[i] = len;
+    }
+    for (i = 0; i < 29; i++)
+        for (j = 0; j < 1 << lenBits[i] && lenBase[i] + j <= MATCH_MAX; j++)
+            e->lenSym[lenBase[i] + j] = i;
+    for (i = 0; i < 30; i++) {
+        e->dist[i] = rev16(i) >> 11;
+        for (j = 0; j < 1 << distBits[i]; j++) {
+            int d = distBase[i] + j - 1;
+            e->distSym[d < 256 ? d : 256 + (d >> 7)] = i;
+        }
+    }
+}
+
+// Distances past 256 are looked up 128 at a time, their symbols have at
+// least 7 extra bits.
+static int dist_sym(const Encoder *e, int dist) {
+    return dist <= 256 ? e->distSym[dist - 1] : e->distSym[256 + ((dist - 1) >> 7)];
+}
+
+// Up to 32 bits at a time. All 8 bytes are stored every time without a
+// branch and `out` moves past the whole ones, it needs 8 bytes of room.
+static inline void put_bits(Bits *b, uint64_t v, int n) {
+    b->bits |= v << b->count;
+    b->count += n;
+    store64le(b->out, b->bits);
+    b->out += b->count >> 3;
+    b->bits >>= b->count & ~7;
+    b->count &= 7;
+}
+
+static inline void put_literal(const Encoder *e, Bits *b, int c) {
+    put_bits(b, e->lit[c], e->litLen[c]);
+}
+
+static inline void put_match(const Encoder *e, Bits *b, int len, int dist) {
+    int ls = e->lenSym[len], ds = dist_sym(e, dist);
+    int n = e->litLen[257 + ls];
+    uint64_t v = e->lit[257 + ls] | (uint64_t)(len - lenBase[ls]) << n;
+    n += lenBits[ls];
+    v |= (uint64_t)(e->dist[ds] | (dist - distBase[ds]) << 5) << n;
+    put_bits(b, v, n + 5 + distBits[ds]);
+}
+
+static int match_len(const unsigned char *a, const unsigned char *b, int max) {
+    int len = 0;
+    for (; len + 8 <= max; len += 8) {
+        uint64_t x = load64le(a + len) ^ load64le(b + len);
+        if (x) {
+            for (; !(x & 0xff); x >>= 8)
+                len++;
+            return len;
+        }
+    }
+    while (len < max && a[len] == b[len])
+        len++;
+    return len;
+}
+
+static uint32_t hash4(const unsigned char *p) {
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return (v * 2654435761u) >> (32 - ENCODE_HASH_BITS);
+}
+
+// One fixed Huffman block. Every level first tries the last byte and the
+// last pixel again, which covers runs and most of what's left of smooth
+// areas once they're filtered, then follows hash chains `chain` long.
+// Positions inside a match are only indexed for matches up to `insert`
+// long: they find repeats further back, but on short chains they crowd out
+// everything else. Returns NULL if the output wouldn't be any smaller than
+// storing it, or its end.
+static unsigned char* deflate_fixed(const Encoder *e, unsigned char *out, const unsigned char *limit, const unsigned char *src, int n, int level, int bpp, int32_t *head, int32_t *prev) {
+    static const short chains[10] = { 0, 1, 4, 8, 16, 32, 64, 128, 256, 1024 };
+    static const short nices[10] = { 0, 8, 16, 32, 64, 128, 258, 258, 258, 258 };
+    static const short inserts[10] = { 0, 0, 0, 0, 8, 16, 32, 64, 258, 258 };
+    int chain = chains[level], nice = nices[level], insert = inserts[level];
+    int i = 0, j, len;
+    Bits b = { out, 0, 0 };
+    put_bits(&b, 3, 3);  // final block, fixed Huffman
+    while (i < n) {
+        int max = n - i < MATCH_MAX ? n - i : MATCH_MAX;
+        int best = 0, dist = 0;
+        if (max >= 3 && i >= 1 && (len = match_len(src + i - 1, src + i, max)) >= 3) {
+            best = len;
+            dist = 1;
+        }
+        if (max >= 3 && bpp > 1 && i >= bpp && best < max && (len = match_len(src + i - bpp, src + i, max)) > best && len >= 3) {
+            best = len;
+            dist = bpp;
+        }
+        if (max >= 4) {
+            uint32_t h = hash4(src + i);
+            int32_t cand = head[h];
+            int tries = best < nice ? chain : 0;
+            prev[i & (ENCODE_WINDOW - 1)] = cand;
+            head[h] = i;
+            // Stopping short of the full window keeps the chain from reaching
+            // a slot this position has just overwritten.
+            for (; best < max && cand >= 0 && i - cand < ENCODE_WINDOW && tries--; cand = prev[cand & (ENCODE_WINDOW - 1)]) {
+                if (src[cand + best] != src[i + best])
+                    continue;
+                len = match_len(src + cand, src + i, max);
+                if (len > best && len >= 4) {
+                    best = len;
+                    dist = i - cand;
+                    if (len >= nice)
+                        break;
+                }
+            }
+        }
+        if (best) {
+            put_match(e, &b, best, dist);
+            if (best <= insert)
+                for (j = i + 1; j < i + best && j + 4 <= n; j++) {
+                    uint32_t h = hash4(src + j);
+                    prev[j & (ENCODE_WINDOW - 1)] = head[h];
+                    head[h] = j;
+                }
+            i += best;
+        } else
+            put_literal(e, &b, src[i++]);
+        if (b.out >= limit)
+            return NULL;
+    }
+    put_bits(&b, 0, 7);  // end of block
+    b.out += b.count > 0;
+    return b.out < limit ? b.out : NULL;
+}
+
+static unsigned char* deflate_stored(unsigned char *out, const unsigned char *src, int n) {
+    do {
+        int len = n < 65535 ? n : 65535;
+        *out++ = len == n;
+        *out++ = len;
+        *out++ = len >> 8;
+        *out++ = ~len;
+        *out++ = ~len >> 8;
+        memcpy(out, src, len);
+        out += len;
+        src += len;
+        n -= len;
+    } while (n);
+    return out;
+}
+
+#if defined(JEFF_PNG_SSE2)
+static __m128i paeth16(__m128i a, __m128i b, __m128i c) {
+    __m128i pa = _mm_sub_epi16(b, c), pb = _mm_sub_epi16(a, c), pc, smallest;
+    pc = abs16(_mm_add_epi16(pa, pb));
+    pa = abs16(pa);
+    pb = abs16(pb);
+    smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+    return select16(_mm_cmpeq_epi16(smallest, pa), a, select16(_mm_cmpeq_epi16(smallest, pb), b, c));
+}
+#elif defined(JEFF_PNG_NEON)
+static uint8x8_t paeth8(uint8x8_t a8, uint8x8_t b8, uint8x8_t c8) {
+    int16x8_t a = vreinterpretq_s16_u16(vmovl_u8(a8)), b = vreinterpretq_s16_u16(vmovl_u8(b8));
+    int16x8_t c = vreinterpretq_s16_u16(vmovl_u8(c8)), pa, pb, pc, smallest;
+    pa = vsubq_s16(b, c);
+    pb = vsubq_s16(a, c);
+    pc = vabsq_s16(vaddq_s16(pa, pb));
+    pa = vabsq_s16(pa);
+    pb = vabsq_s16(pb);
+    smallest = vminq_s16(pc, vminq_s16(pa, pb));
+    return vmovn_u16(vreinterpretq_u16_s16(vbslq_s16(vceqq_s16(smallest, pa), a,
+                                                     vbslq_s16(vceqq_s16(smallest, pb), b, c))));
+}
+#endif
+
+// Filtering only reads the unfiltered rows, so unlike unfiltering every byte
+// stands on its own and they go 16 at a time. Starts at `x`, which is past
+// the first pixel, and returns where it stopped.
+static int filter_vec(int f, unsigned char *d, const unsigned char *cur, const unsigned char *prior, int x, int len, int bpp) {
+#if defined(JEFF_PNG_SSE2)
+    __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi8(1);
+    for (; x + 16 <= len; x += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*)(cur + x - bpp));
+        __m128i b = _mm_loadu_si128((const __m128i*)(prior + x)), c, p;
+        switch (f) {
+            case 1:
+                p = a;
+                break;
+            case 2:
+                p = b;
+                break;
+            case 3:
+                // _mm_avg_epu8 rounds up
+                p = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+                break;
+            default:
+                c = _mm_loadu_si128((const __m128i*)(prior + x - bpp));
+                p = _mm_packus_epi16(paeth16(_mm_unpacklo_epi8(a, zero), _mm_unpacklo_epi8(b, zero), _mm_unpacklo_epi8(c, zero)),
+                                     paeth16(_mm_unpackhi_epi8(a, zero), _mm_unpackhi_epi8(b, zero), _mm_unpackhi_epi8(c, zero)));
+        }
+        _mm_storeu_si128((__m128i*)(d + x), _mm_sub_epi8(_mm_loadu_si128((const __m128i*)(cur + x)), p));
+    }
+#elif defined(JEFF_PNG_NEON)
+    for (; x + 16 <= len; x += 16) {
+        uint8x16_t a = vld1q_u8(cur + x - bpp), b = vld1q_u8(prior + x), c, p;
+        switch (f) {
+            case 1:
+                p = a;
+                break;
+            case 2:
+                p = b;
+                break;
+            case 3:
+                p = vhaddq_u8(a, b);
+                break;
+            default:
+                c = vld1q_u8(prior + x - bpp);
+                p = vcombine_u8(paeth8(vget_low_u8(a), vget_low_u8(b), vget_low_u8(c)),
+                                paeth8(vget_high_u8(a), vget_high_u8(b), vget_high_u8(c)));
+        }
+        vst1q_u8(d + x, vsubq_u8(vld1q_u8(cur + x), p));
+    }
+#endif
+    return x;
+}
+
+static void filter(int f, unsigned char *d, const unsigned char *cur, const unsigned char *prior, int len, int bpp) {
+    int x;
+#define LOOP(A, B)                                 \
+    for (x = 0; x < bpp; x++)                      \
+        d[x] = cur[x] - (A);                       \
+    x = filter_vec(f, d, cur, prior, x, len, bpp); \
+    for (; x < len; x++)                           \
+        d[x] = cur[x] - (B);                       \
+    break
+    switch (f) {
+        case 0:
+            memcpy(d, cur, len);
+            break;
+        case 1:
+            LOOP(0, cur[x - bpp]);
+        case 2:
+            LOOP(prior[x], prior[x]);
+        case 3:
+            LOOP(prior[x] / 2, (cur[x - bpp] + prior[x]) / 2);
+        case 4:
+            LOOP(prior[x], paeth(cur[x - bpp], prior[x], prior[x - bpp]));
+    }
+#undef LOOP
+}
+
+// Sum of a filtered row's bytes taken as signed, min(x, -x) of an unsigned
+// byte is its size either way.
+static uint64_t filter_cost(const unsigned char *d, int len) {
+    uint64_t sum = 0;
+    int i = 0;
+#if defined(JEFF_PNG_SSE2)
+    __m128i zero = _mm_setzero_si128(), acc = zero;
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(d + i));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_min_epu8(v, _mm_sub_epi8(zero, v)), zero));
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i*)lanes, acc);
+    sum = lanes[0] + lanes[1];
+#elif defined(JEFF_PNG_NEON)
+    uint64x2_t acc = vdupq_n_u64(0);
+    for (; i + 16 <= len; i += 16) {
+        uint8x16_t v = vld1q_u8(d + i);
+        uint8x16_t m = vminq_u8(v, vreinterpretq_u8_s8(vnegq_s8(vreinterpretq_s8_u8(v))));
+        acc = vpadalq_u32(acc, vpaddlq_u16(vpaddlq_u8(m)));
+    }
+    sum = vgetq_lane_u64(acc, 0) + vgetq_lane_u64(acc, 1);
+#endif
+    for (; i < len; i++)
+        sum += d[i] < 128 ? d[i] : 256 - d[i];
+    return sum;
+}
+
+// Each row gets the filter that leaves the smallest sum of its bytes taken
+// as signed, the usual guess at what compresses best. Level 0 doesn't filter
+// and level 1 only tries none, sub and up.
+static void filter_row(unsigned char *dest, const unsigned char *cur, const unsigned char *prior, int len, int bpp, int level, unsigned char *tmp) {
+    uint64_t best = UINT64_MAX;
+    int filters = level == 0 ? 1 : level == 1 ? 3 : 5;
+    int f, pick = 0;
+    for (f = 0; f < filters; f++) {
+        unsigned char *d = f ? tmp + (f - 1) * len : dest + 1;
+        uint64_t sum;
+        filter(f, d, cur, prior, len, bpp);
+        sum = filters > 1 ? filter_cost(d, len) : 0;
+        if (sum < best) {
+            best = sum;
+            pick = f;
+        }
+    }
+    dest[0] = pick;
+    if (pick)
+        memcpy(dest + 1, tmp + (pick - 1) * len, len);
+}
+
+// 16-bit samples are written big endian, opaque RGBA8 as RGB.
+static const unsigned char* encode_row(unsigned char *dest, const unsigned char *src, int w, sg_pixel_format format, int rgb) {
+    int i;
+    switch (format) {
+        case SG_PIXELFORMAT_R16:
+        case SG_PIXELFORMAT_RG16:
+        case SG_PIXELFORMAT_RGBA16:
+            swap16(src, dest, w * format_bytes(format));
+            return dest;
+        default:
+            if (!rgb)
+                return src;
+            for (i = 0; i < w; i++) {
+                dest[i * 3] = src[i * 4];
+                dest[i * 3 + 1] = src[i * 4 + 1];
+                dest[i * 3 + 2] = src[i * 4 + 2];
+            }
+            return dest;
+    }
+}
+
+static void put_chunk(unsigned char *p, const char *type, uint32_t len) {
+    put32(p, len);
+    memcpy(p + 4, type, 4);
+    put32(p + 8 + len, crc_update(0, p + 4, len + 4));
+}
+
+void* jeff_png_encode(const void *pixels, int width, int height, int pitch, sg_pixel_format format, int level, size_t *size) {
+    int ctype, depth = 8, channels, rgb = 0;
+    switch (format) {
+        case SG_PIXELFORMAT_R8:
+        case SG_PIXELFORMAT_R16:
+            ctype = 0;
+            channels = 1;
+            break;
+        case SG_PIXELFORMAT_RG8:
+        case SG_PIXELFORMAT_RG16:
+            ctype = 4;
+            channels = 2;
+            break;
+        case SG_PIXELFORMAT_RGBA8:
+        case SG_PIXELFORMAT_RGBA16:
+            ctype = 6;
+            channels = 4;
+            break;
+        default:
+            errno = EINVAL;
+            return NULL;
+    }
+    if (format == SG_PIXELFORMAT_R16 || format == SG_PIXELFORMAT_RG16 || format == SG_PIXELFORMAT_RGBA16)
+        depth = 16;
+    int packed = format_bytes(format);
+    if (!pixels || width <= 0 || height <= 0 || width > INT_MAX / packed || pitch < 0 || (pitch && pitch < width * packed)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (!pitch)
+        pitch = width * packed;
+    level = level < 0 ? 0 : level > 9 ? 9 : level;
+
+    const unsigned char *px = pixels;
+    int x, y;
+    if (format == SG_PIXELFORMAT_RGBA8) {
+        unsigned char alpha = 255;
+        for (y = 0; y < height && alpha == 255; y++)
+            for (x = 0; x < width; x++)
+                alpha &= px[(size_t)y * pitch + x * 4 + 3];
+        if (alpha == 255) {
+            ctype = 2;
+            channels = 3;
+        }
+        rgb = alpha == 255;
+    }
+    int bpp = channels * depth / 8;
+    int len = width * bpp;
+    if (((size_t)len + 1) * height > INT_MAX - 1024) {
+        errno = EINVAL;
+        return NULL;
+    }
+    int raw = (len + 1) * height;
+    // IDAT holds zlib's two byte header, the stored blocks' five and Adler-32
+    size_t idat = 2 + raw + 5 * (raw / 65535 + 1) + 4;
+    size_t total = 8 + 25 + 12 + idat + 12;
+    unsigned char *filtered = malloc(raw);
+    unsigned char *rows = calloc(len, 7);
+    unsigned char *out = malloc(total + 16);
+    int32_t *head = NULL, *prev = NULL;
+    if (level) {
+        head = malloc(sizeof(int32_t) * (1 << ENCODE_HASH_BITS));
+        prev = malloc(sizeof(int32_t) * ENCODE_WINDOW);
+    }
+    if (!filtered || !rows || !out || (level && (!head || !prev))) {
+        free(filtered);
+        free(rows);
+        free(out);
+        free(head);
+        free(prev);
         return NULL;
     }
-    if (w)
-        *w = tmp->w;
-    if (h)
-        *h = tmp->h;
-    return tmp->buf;
+
+    // Every row is filtered ahead of compressing, so the matcher can see
+    // across them.
+    const unsigned char *prior = rows;  // zeroes above the first row
+    for (y = 0; y < height; y++) {
+        unsigned char *convert = rows + len * (1 + (y & 1));
+        const unsigned char *cur = encode_row(convert, px + (size_t)y * pitch, width, format, rgb);
+        filter_row(filtered + (size_t)y * (len + 1), cur, prior, len, bpp, level, rows + len * 3);
+        prior = cur;
+    }
+
+    crc_ready();
+    memcpy(out, "\x89PNG\r\n\x1a\n", 8);
+    unsigned char *ihdr = out + 8;
+    put32(ihdr + 8, width);
+    put32(ihdr + 12, height);
+    ihdr[16] = depth;
+    ihdr[17] = ctype;
+    ihdr[18] = ihdr[19] = ihdr[20] = 0;
+    put_chunk(ihdr, "IHDR", 13);
+
+    unsigned char *z = out + 8 + 25 + 8, *end = NULL;
+    z[0] = 0x78;
+    z[1] = 0x01;
+    Encoder *e = level ? malloc(sizeof(Encoder)) : NULL;
+    if (e) {
+        encoder_init(e);
+        if (head)
+            memset(head, 0xff, sizeof(int32_t) * (1 << ENCODE_HASH_BITS));
+        end = deflate_fixed(e, z + 2, z + idat - 4, filtered, raw, level, bpp, head, prev);
+    }
+    // Anything that doesn't compress is stored instead
+    if (!end)
+        end = deflate_stored(z + 2, filtered, raw);
+    put32(end, adler_update(1, filtered, raw));
+    end += 4;
+    put_chunk(z - 8, "IDAT", (uint32_t)(end - z));
+    end += 4;
+    put_chunk(end, "IEND", 0);
+    end += 12;
+
+    free(e);
+    free(filtered);
+    free(rows);
+    free(head);
+    free(prev);
+    *size = end - out;
+    unsigned char *shrunk = realloc(out, *size);
+    return shrunk ? shrunk : out;
+}
+
+int jeff_png_save(const char *path, const void *pixels, int width, int height, int pitch, sg_pixel_format format, int level) {
+    size_t size;
+    void *data = jeff_png_encode(pixels, width, height, pitch, format, level, &size);
+    FILE *fh;
+    int result;
+    if (!data)
+        return 0;
+    if (!(fh = fopen(path, "wb"))) {
+        free(data);
+        return 0;
+    }
+    result = fwrite(data, size, 1, fh) == 1;
+    result = !fclose(fh) && result;
+    free(data);
+    return result;
+}
+
+static int* load_texture_data(unsigned char *data, int data_size, int *w, int *h) {
+    // A one-off decoder, the caller takes the image off it.
+    jeff_png_decoder dec = { 0 };
+    int *result = (int*)jeff_png_decoder_load(&dec, data, data_size, w, h);
+    if (result)
+        dec.image.ptr = NULL;
+    release_decoder(&dec);
+    return result;
+}
+
+int jeff_png_decode_rows(unsigned char *data, int data_size, jeff_png_row_cb cb, void *userdata, int *width, int *height) {
+    jeff_png_decoder dec = { 0 };
+    int result = jeff_png_decoder_rows(&dec, data, data_size, cb, userdata, width, height);
+    release_decoder(&dec);
+    return result;
 }
 
 sg_image sg_load_texture_memory_ex(unsigned char *data, int data_size, int *width, int *height) {